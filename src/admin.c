@@ -0,0 +1,415 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include "datatypes.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "admin.h"
+#include "tcp.h"
+#include "pool.h"
+#include "log.h"
+
+static void admin_conn_close(admin_t* a, int idx)
+{
+  admin_conn_t* c = &(a->conns_[idx]);
+  poller_set(a->poller_, c->fd_, 0);
+  close(c->fd_);
+  if(c->response_)
+    free(c->response_);
+  a->num_conns_--;
+  memmove(c, c + 1, (a->num_conns_ - idx) * sizeof(admin_conn_t));
+}
+
+/* spec is either the path of a UNIX socket or address:port, every worker
+   gets its own socket with the worker number appended to the path or
+   added to the port */
+static int admin_open(admin_t* a, const char* spec, int worker)
+{
+  if(spec[0] == '/' || !strrchr(spec, ':')) {
+    struct sockaddr_un sun;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    int len = worker < 0 ? asprintf(&(a->path_), "%s", spec) : asprintf(&(a->path_), "%s.%d", spec, worker);
+    if(len < 0) {
+      a->path_ = NULL;
+      return -2;
+    }
+    if(len >= (int)sizeof(sun.sun_path)) {
+      log_printf(ERROR, "admin socket path %s is too long", a->path_);
+      return -1;
+    }
+    strcpy(sun.sun_path, a->path_);
+    a->fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(a->fd_ < 0) {
+      log_printf(ERROR, "Error on socket(): %s", strerror(errno));
+      return -1;
+    }
+    unlink(a->path_);
+    if(bind(a->fd_, (struct sockaddr *)&sun, sizeof(sun))) {
+      log_printf(ERROR, "Error on bind(%s): %s", a->path_, strerror(errno));
+      return -1;
+    }
+    return 0;
+  }
+
+  char* addr = strdup(spec);
+  if(!addr)
+    return -2;
+  char* port = strrchr(addr, ':');
+  *(port++) = 0;
+  char* host = addr;
+  if(host[0] == '[' && host[strlen(host) - 1] == ']') {
+    host[strlen(host) - 1] = 0;
+    host++;
+  }
+  char* end;
+  errno = 0;
+  long p = strtol(port, &end, 10) + (worker < 0 ? 0 : worker);
+  if(errno || end == port || *end || p < 1 || p > 65535) {
+    log_printf(ERROR, "illegal admin port '%s' for worker %d", port, worker);
+    free(addr);
+    return -1;
+  }
+  char portstr[6];
+  snprintf(portstr, sizeof(portstr), "%ld", p);
+
+  struct addrinfo* ai = tcp_resolve_endpoint(host, portstr, ANY, TCP_RESOLVE_PASSIVE);
+  free(addr);
+  if(!ai)
+    return -1;
+
+  a->fd_ = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if(a->fd_ < 0) {
+    log_printf(ERROR, "Error on socket(): %s", strerror(errno));
+    freeaddrinfo(ai);
+    return -1;
+  }
+  int on = 1;
+  setsockopt(a->fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  int ret = bind(a->fd_, ai->ai_addr, ai->ai_addrlen);
+  freeaddrinfo(ai);
+  if(ret) {
+    log_printf(ERROR, "Error on bind(%s): %s", spec, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+int admin_init(admin_t* a, const char* spec, int worker, poller_t* poller)
+{
+  a->fd_ = -1;
+  a->path_ = NULL;
+  a->poller_ = poller;
+  a->num_conns_ = 0;
+  if(!spec)
+    return 0;
+
+  int ret = admin_open(a, spec, worker);
+  if(!ret && listen(a->fd_, ADMIN_MAX_CONNECTIONS)) {
+    log_printf(ERROR, "Error on listen(): %s", strerror(errno));
+    ret = -1;
+  }
+  if(!ret && poller_set(poller, a->fd_, POLLER_READ)) {
+    log_printf(ERROR, "unable to add admin socket to event loop");
+    ret = -1;
+  }
+  if(ret) {
+    admin_clear(a);
+    return ret;
+  }
+  log_printf(NOTICE, "admin socket listening on %s", a->path_ ? a->path_ : spec);
+  return 0;
+}
+
+void admin_clear(admin_t* a)
+{
+  while(a->num_conns_)
+    admin_conn_close(a, a->num_conns_ - 1);
+  if(a->fd_ >= 0) {
+    poller_set(a->poller_, a->fd_, 0);
+    close(a->fd_);
+    if(a->path_)
+      unlink(a->path_);
+  }
+  a->fd_ = -1;
+  if(a->path_)
+    free(a->path_);
+  a->path_ = NULL;
+}
+
+static void admin_printf(admin_conn_t* c, const char* fmt, ...)
+{
+  for(;;) {
+    va_list args;
+    va_start(args, fmt);
+    int len = c->response_ ? vsnprintf(&(c->response_[c->response_len_]), c->response_size_ - c->response_len_, fmt, args) : -1;
+    va_end(args);
+    if(len >= 0 && c->response_len_ + len < c->response_size_) {
+      c->response_len_ += len;
+      return;
+    }
+
+    u_int32_t size = c->response_size_ ? c->response_size_ * 2 : 16384;
+    char* response = realloc(c->response_, size);
+    if(!response)
+      return;
+    c->response_ = response;
+    c->response_size_ = size;
+  }
+}
+
+static void admin_metric(admin_conn_t* c, const char* name, const char* type, const char* help)
+{
+  admin_printf(c, "# HELP tcpproxy_%s %s\n# TYPE tcpproxy_%s %s\n", name, help, name, type);
+}
+
+static void admin_write_clients(admin_conn_t* c, clients_t* clients, u_int64_t loops)
+{
+  admin_metric(c, "loop_iterations_total", "counter", "Iterations of the event loop.");
+  admin_printf(c, "tcpproxy_loop_iterations_total %llu\n", (unsigned long long)loops);
+  admin_metric(c, "clients", "gauge", "Client connections by state.");
+  admin_printf(c, "tcpproxy_clients{state=\"waiting\"} %d\n", clients->states_[WAITING]);
+  admin_printf(c, "tcpproxy_clients{state=\"connecting\"} %d\n", clients->states_[CONNECTING]);
+  admin_printf(c, "tcpproxy_clients{state=\"connected\"} %d\n", clients->states_[CONNECTED]);
+  admin_printf(c, "tcpproxy_clients{state=\"closing\"} %d\n", clients->states_[CLOSING]);
+  admin_metric(c, "connection_setups_total", "counter", "Client connections which got connected to a backend.");
+  admin_printf(c, "tcpproxy_connection_setups_total %llu\n", (unsigned long long)clients->setups_);
+  admin_metric(c, "connection_setup_syscalls_total", "counter", "System calls made to set up client connections.");
+  admin_printf(c, "tcpproxy_connection_setup_syscalls_total %llu\n", (unsigned long long)clients->setup_syscalls_);
+}
+
+static void admin_write_listeners(admin_conn_t* c, listeners_t* listeners)
+{
+  int i, j, num = slist_length(&(listeners->list_));
+  listener_t** list = calloc(num ? num : 1, sizeof(listener_t*));
+  char** names = calloc(num ? num : 1, sizeof(char*));
+  if(!list || !names) {
+    if(list) free(list);
+    if(names) free(names);
+    return;
+  }
+  slist_element_t* tmp = listeners->list_.first_;
+  for(i = 0; tmp && i < num; tmp = tmp->next_, ++i) {
+    list[i] = (listener_t*)tmp->data_;
+    names[i] = tcp_endpoint_to_string(list[i]->local_end_);
+  }
+
+  admin_metric(c, "paused", "gauge", "Whether accepting new connections is paused because of overload.");
+  admin_printf(c, "tcpproxy_paused %d\n", listeners->paused_ ? 1 : 0);
+  admin_metric(c, "pauses_total", "counter", "Times accepting new connections was paused.");
+  admin_printf(c, "tcpproxy_pauses_total %llu\n", (unsigned long long)listeners->pauses_);
+
+  admin_metric(c, "listener_accepts_total", "counter", "Connections accepted.");
+  for(i = 0; i < num; ++i)
+    admin_printf(c, "tcpproxy_listener_accepts_total{listener=\"%s\"} %llu\n", names[i] ? names[i] : "", (unsigned long long)list[i]->accepts_);
+  admin_metric(c, "listener_shed_total", "counter", "Connections closed right away because of overload.");
+  for(i = 0; i < num; ++i)
+    admin_printf(c, "tcpproxy_listener_shed_total{listener=\"%s\"} %llu\n", names[i] ? names[i] : "", (unsigned long long)list[i]->shed_);
+  admin_metric(c, "listener_bytes_total", "counter", "Bytes relayed, upstream is from the clients to the backends.");
+  for(i = 0; i < num; ++i) {
+    admin_printf(c, "tcpproxy_listener_bytes_total{listener=\"%s\",direction=\"upstream\"} %llu\n", names[i] ? names[i] : "", (unsigned long long)list[i]->bytes_->transferred_[1]);
+    admin_printf(c, "tcpproxy_listener_bytes_total{listener=\"%s\",direction=\"downstream\"} %llu\n", names[i] ? names[i] : "", (unsigned long long)list[i]->bytes_->transferred_[0]);
+  }
+
+  const char* metrics[] = { "backend_active_connections", "backend_connect_failures_total", "backend_ejected", "backend_preconnected" };
+  const char* types[] = { "gauge", "counter", "gauge", "gauge" };
+  const char* helps[] = { "Client connections to the backend.", "Failed connections to the backend including health checks and preconnects.",
+                          "Whether the backend is ejected because of failures.", "Established idle connections to the backend." };
+  int m;
+  for(m = 0; m < 4; ++m) {
+    admin_metric(c, metrics[m], types[m], helps[m]);
+    for(i = 0; i < num; ++i) {
+      backends_t* b = list[i]->backends_;
+      for(j = 0; j < b->len_; ++j) {
+        if(b->list_[j].stale_ && !b->list_[j].active_)
+          continue;
+        unsigned long long value = 0;
+        switch(m) {
+        case 0: value = b->list_[j].active_; break;
+        case 1: value = b->list_[j].connect_failures_; break;
+        case 2: value = backends_ejected(b, j) ? 1 : 0; break;
+        case 3: value = backends_spares_ready(b, j); break;
+        }
+        char* rs = tcp_endpoint_to_string(b->list_[j].addr_);
+        admin_printf(c, "tcpproxy_%s{listener=\"%s\",backend=\"%s\"} %llu\n", metrics[m], names[i] ? names[i] : "", rs ? rs : "", value);
+        if(rs) free(rs);
+      }
+    }
+  }
+
+  for(i = 0; i < num; ++i)
+    if(names[i]) free(names[i]);
+  free(names);
+  free(list);
+}
+
+static void admin_write_pool(admin_conn_t* c)
+{
+  const pool_t* p = pool_stats();
+  size_t used = p->fallback_size_;
+  int i;
+  for(i = 0; i < p->num_classes_; ++i)
+    used += p->classes_[i].size_ * p->classes_[i].used_;
+
+  admin_metric(c, "pool_limit_bytes", "gauge", "Maximum size of the buffer pool.");
+  admin_printf(c, "tcpproxy_pool_limit_bytes %zu\n", p->max_size_);
+  admin_metric(c, "pool_reserved_bytes", "gauge", "Memory reserved by the buffer pool.");
+  admin_printf(c, "tcpproxy_pool_reserved_bytes %zu\n", p->size_);
+  admin_metric(c, "pool_used_bytes", "gauge", "Memory of the buffer pool handed out for clients and buffers, including allocations which fell back to malloc().");
+  admin_printf(c, "tcpproxy_pool_used_bytes %zu\n", used);
+  admin_metric(c, "pool_chunks", "gauge", "Chunks of the buffer pool by size and state.");
+  for(i = 0; i < p->num_classes_; ++i) {
+    admin_printf(c, "tcpproxy_pool_chunks{size=\"%zu\",state=\"used\"} %u\n", p->classes_[i].size_, p->classes_[i].used_);
+    admin_printf(c, "tcpproxy_pool_chunks{size=\"%zu\",state=\"free\"} %u\n", p->classes_[i].size_, p->classes_[i].free_len_);
+  }
+}
+
+/* anything that doesn't look like a HTTP request gets the plain metrics,
+   this way a simple socat or nc is enough to read them */
+static void admin_respond(admin_t* a, admin_conn_t* c, listeners_t* listeners, clients_t* clients, u_int64_t loops)
+{
+  c->request_[c->request_len_ < ADMIN_REQUEST_MAX ? c->request_len_ : ADMIN_REQUEST_MAX - 1] = 0;
+  int head = !strncmp(c->request_, "HEAD ", 5);
+  int http = head || !strncmp(c->request_, "GET ", 4);
+  const char* path = strchr(c->request_, ' ');
+  if(http && strncmp(path, " / ", 3) && strncmp(path, " /metrics ", 10)) {
+    admin_printf(c, "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\nnot found\n");
+    return;
+  }
+
+  u_int32_t header = 0;
+  if(http) {
+    /* the length is patched in once the body is complete */
+    admin_printf(c, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\nContent-Length: %10u\r\n\r\n", 0);
+    header = c->response_len_;
+  }
+  admin_write_clients(c, clients, loops);
+  admin_write_listeners(c, listeners);
+  admin_write_pool(c);
+  if(!c->response_)
+    return;
+  if(http) {
+    char* cl = strstr(c->response_, "Content-Length: ") + strlen("Content-Length: ");
+    char len[11];
+    snprintf(len, sizeof(len), "%10u", c->response_len_ - header);
+    memcpy(cl, len, 10);
+    if(head)
+      c->response_len_ = header;
+  }
+}
+
+static void admin_accept(admin_t* a)
+{
+  for(;;) {
+    int fd = accept4(a->fd_, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if(fd < 0) {
+      if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+        log_printf(WARNING, "Error on accept() for admin socket: %s", strerror(errno));
+      if(errno != EINTR && errno != ECONNABORTED)
+        return;
+      continue;
+    }
+    if(a->num_conns_ >= ADMIN_MAX_CONNECTIONS) {
+      log_printf(WARNING, "too many admin connections, closing the oldest one");
+      admin_conn_close(a, 0);
+    }
+    if(poller_set(a->poller_, fd, POLLER_READ)) {
+      close(fd);
+      continue;
+    }
+    admin_conn_t* c = &(a->conns_[a->num_conns_++]);
+    c->fd_ = fd;
+    c->request_len_ = 0;
+    c->response_ = NULL;
+    c->response_len_ = 0;
+    c->response_size_ = 0;
+    c->response_offset_ = 0;
+  }
+}
+
+static int admin_request_complete(admin_conn_t* c)
+{
+  if(c->request_len_ >= ADMIN_REQUEST_MAX - 1)
+    return 1;
+  if(!strncmp(c->request_, "GET ", 4) || !strncmp(c->request_, "HEAD ", 5))
+    return strstr(c->request_, "\r\n\r\n") || strstr(c->request_, "\n\n");
+  return strchr(c->request_, '\n') != NULL;
+}
+
+/* returns 1 if the connection is done with */
+static int admin_conn_handle(admin_t* a, admin_conn_t* c, listeners_t* listeners, clients_t* clients, u_int64_t loops)
+{
+  int ready = poller_ready(a->poller_, c->fd_);
+  if(ready & POLLER_READ) {
+    int len = recv(c->fd_, &(c->request_[c->request_len_]), ADMIN_REQUEST_MAX - 1 - c->request_len_, 0);
+    if(len < 0)
+      return errno != EAGAIN && errno != EWOULDBLOCK;
+    c->request_len_ += len;
+    c->request_[c->request_len_] = 0;
+    if(len && !admin_request_complete(c))
+      return 0;
+
+    admin_respond(a, c, listeners, clients, loops);
+    if(!c->response_ || poller_set(a->poller_, c->fd_, POLLER_WRITE))
+      return 1;
+    ready = POLLER_WRITE;
+  }
+  if(ready & POLLER_WRITE) {
+    int len = send(c->fd_, &(c->response_[c->response_offset_]), c->response_len_ - c->response_offset_, MSG_NOSIGNAL);
+    if(len < 0)
+      return errno != EAGAIN && errno != EWOULDBLOCK;
+    c->response_offset_ += len;
+    return c->response_offset_ >= c->response_len_;
+  }
+  return 0;
+}
+
+void admin_handle_ready(admin_t* a, listeners_t* listeners, clients_t* clients, u_int64_t loops)
+{
+  if(a->fd_ < 0)
+    return;
+
+  if(poller_ready(a->poller_, a->fd_) & POLLER_READ)
+    admin_accept(a);
+
+  int i;
+  for(i = a->num_conns_ - 1; i >= 0; --i) {
+    if(admin_conn_handle(a, &(a->conns_[i]), listeners, clients, loops))
+      admin_conn_close(a, i);
+  }
+}
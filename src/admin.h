@@ -0,0 +1,60 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCPPROXY_admin_h_INCLUDED
+#define TCPPROXY_admin_h_INCLUDED
+
+#include "poller.h"
+#include "listener.h"
+#include "clients.h"
+
+#define ADMIN_MAX_CONNECTIONS 16
+#define ADMIN_REQUEST_MAX 2048
+
+typedef struct {
+  int fd_;
+  char request_[ADMIN_REQUEST_MAX];
+  u_int32_t request_len_;
+  char* response_;
+  u_int32_t response_len_;
+  u_int32_t response_size_;
+  u_int32_t response_offset_;
+} admin_conn_t;
+
+typedef struct {
+  int fd_;
+  char* path_;
+  poller_t* poller_;
+  admin_conn_t conns_[ADMIN_MAX_CONNECTIONS];
+  int num_conns_;
+} admin_t;
+
+int admin_init(admin_t* a, const char* spec, int worker, poller_t* poller);
+void admin_clear(admin_t* a);
+void admin_handle_ready(admin_t* a, listeners_t* listeners, clients_t* clients, u_int64_t loops);
+
+#endif
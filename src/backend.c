@@ -0,0 +1,1246 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include "datatypes.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "backend.h"
+#include "tcp.h"
+#include "log.h"
+
+static backends_t* backends_first = NULL;
+static poller_t* backends_poller = NULL;
+static timer_wheel_t backends_timers;
+static int backends_probing = 0;
+static int backends_spares = 0;
+static backend_fd_t* backends_fds = NULL;
+static int backends_fds_len = 0;
+
+/* health checks and preconnected sockets are looked up by fd when the
+   poller reports them, spare is -1 for the health check of a backend */
+static int backends_map_fd(int fd, backends_t* b, int idx, int spare)
+{
+  if(fd >= backends_fds_len) {
+    int len = backends_fds_len ? backends_fds_len : 1024;
+    while(len <= fd)
+      len *= 2;
+    backend_fd_t* fds = realloc(backends_fds, len * sizeof(backend_fd_t));
+    if(!fds)
+      return -2;
+    memset(&(fds[backends_fds_len]), 0, (len - backends_fds_len) * sizeof(backend_fd_t));
+    backends_fds = fds;
+    backends_fds_len = len;
+  }
+  backends_fds[fd].set_ = b;
+  backends_fds[fd].idx_ = idx;
+  backends_fds[fd].spare_ = spare;
+  return 0;
+}
+
+static void backends_unmap_fd(int fd)
+{
+  if(fd >= 0 && fd < backends_fds_len)
+    backends_fds[fd].set_ = NULL;
+}
+
+static void backends_probe_stop(backend_t* be)
+{
+  if(be->probe_fd_ < 0)
+    return;
+
+  if(backends_poller)
+    poller_set(backends_poller, be->probe_fd_, 0);
+  backends_unmap_fd(be->probe_fd_);
+  close(be->probe_fd_);
+  be->probe_fd_ = -1;
+  backends_probing--;
+}
+
+static void backends_spare_close(backends_t* b, backend_spare_t* s)
+{
+  if(s->fd_ < 0)
+    return;
+
+  if(backends_poller)
+    poller_set(backends_poller, s->fd_, 0);
+  backends_unmap_fd(s->fd_);
+  close(s->fd_);
+  s->fd_ = -1;
+  s->established_ = 0;
+  backends_source_release(b, s->source_);
+  s->source_ = -1;
+  backends_spares--;
+}
+
+static void backends_spares_clear(backends_t* b, backend_t* be)
+{
+  if(!be->spares_)
+    return;
+
+  int i;
+  for(i = 0; i < b->preconnect_; ++i)
+    backends_spare_close(b, &(be->spares_[i]));
+  free(be->spares_);
+  be->spares_ = NULL;
+}
+
+backends_t* backends_new(balance_type_t balance)
+{
+  backends_t* b = malloc(sizeof(backends_t));
+  if(!b)
+    return NULL;
+
+  b->list_ = NULL;
+  b->len_ = 0;
+  b->size_ = 0;
+  b->remotes_ = NULL;
+  b->num_remotes_ = 0;
+  memset(&(b->source_end_.addr_), 0, sizeof(b->source_end_.addr_));
+  b->source_end_.addr_.ss_family = AF_UNSPEC;
+  b->source_end_.len_ = 0;
+  b->sources_ = NULL;
+  b->num_sources_ = 0;
+  b->next_source_ = 0;
+  b->balance_ = balance;
+  b->table_ = NULL;
+  b->table_dirty_ = 1;
+  b->health_.max_fails_ = BACKEND_DEFAULT_MAX_FAILS;
+  b->health_.fail_timeout_ = BACKEND_DEFAULT_FAIL_TIMEOUT * 1000;
+  b->health_.interval_ = 0;
+  b->health_.slow_start_ = 0;
+  b->retries_ = BACKEND_DEFAULT_RETRIES;
+  b->preconnect_ = 0;
+  b->defer_connect_ = 0;
+  tcp_sockopts_init(&(b->sockopts_));
+  timer_entry_init(&(b->probe_timer_), b);
+  timer_entry_init(&(b->spare_timer_), b);
+  b->next_ = 0;
+  b->refcnt_ = 1;
+
+  b->prev_ = NULL;
+  b->next_set_ = backends_first;
+  if(backends_first)
+    backends_first->prev_ = b;
+  backends_first = b;
+  return b;
+}
+
+backends_t* backends_ref(backends_t* b)
+{
+  if(b)
+    b->refcnt_++;
+  return b;
+}
+
+void backends_unref(backends_t* b)
+{
+  if(!b || --(b->refcnt_) > 0)
+    return;
+
+  if(b->prev_)
+    b->prev_->next_set_ = b->next_set_;
+  else
+    backends_first = b->next_set_;
+  if(b->next_set_)
+    b->next_set_->prev_ = b->prev_;
+
+  timer_wheel_cancel(&backends_timers, &(b->probe_timer_));
+  timer_wheel_cancel(&backends_timers, &(b->spare_timer_));
+  int i;
+  for(i = 0; i < b->len_; ++i) {
+    backends_probe_stop(&(b->list_[i]));
+    backends_spares_clear(b, &(b->list_[i]));
+  }
+  for(i = 0; i < b->num_remotes_; ++i)
+    resolver_release(b->remotes_[i].entry_);
+  for(i = 0; i < b->num_sources_; ++i)
+    resolver_release(b->sources_[i].entry_);
+  if(b->remotes_)
+    free(b->remotes_);
+  if(b->list_)
+    free(b->list_);
+  if(b->table_)
+    free(b->table_);
+  if(b->sources_)
+    free(b->sources_);
+  free(b);
+}
+
+static int backends_find(backends_t* b, const tcp_endpoint_t* addr)
+{
+  int i;
+  for(i = 0; i < b->len_; ++i) {
+    if(b->list_[i].addr_.len_ == addr->len_ && !memcmp(&(b->list_[i].addr_.addr_), &(addr->addr_), addr->len_))
+      return i;
+  }
+  return -1;
+}
+
+static int backends_append(backends_t* b, const tcp_endpoint_t* addr, int group)
+{
+  int i, idx = -1;
+  for(i = 0; i < b->len_; ++i) {
+    if(b->list_[i].stale_ && !b->list_[i].active_) {
+      backends_probe_stop(&(b->list_[i]));
+      backends_spares_clear(b, &(b->list_[i]));
+      idx = i;
+      break;
+    }
+  }
+
+  if(idx < 0) {
+    if(b->len_ >= b->size_) {
+      int size = b->size_ ? b->size_ * 2 : 4;
+      backend_t* list = realloc(b->list_, size * sizeof(backend_t));
+      if(!list)
+        return -2;
+      b->list_ = list;
+      b->size_ = size;
+    }
+    idx = b->len_++;
+  }
+
+  backend_t* be = &(b->list_[idx]);
+  memcpy(&(be->addr_), addr, sizeof(tcp_endpoint_t));
+  be->group_ = group;
+  be->weight_ = b->remotes_[group].weight_;
+  be->current_weight_ = 0;
+  be->active_ = 0;
+  be->stale_ = 0;
+  be->failures_ = 0;
+  be->connect_failures_ = 0;
+  be->ejections_ = 0;
+  be->ejected_until_ = 0;
+  be->recovered_at_ = backends_poller ? timer_wheel_now(&backends_timers) : 0;
+  be->probe_fd_ = -1;
+  be->spares_ = NULL;
+  return 0;
+}
+
+/* makes the addresses of the backend list match what the remote currently
+   resolves to, addresses which are gone are only marked stale because open
+   connections refer to them by their index */
+static int backends_sync(backends_t* b, int group)
+{
+  resolver_entry_t* e = b->remotes_[group].entry_;
+  int i, j;
+  for(i = 0; i < b->len_; ++i) {
+    if(b->list_[i].group_ != group)
+      continue;
+    b->list_[i].stale_ = 1;
+    for(j = 0; j < e->len_; ++j) {
+      if(b->list_[i].addr_.len_ == e->addrs_[j].len_ && !memcmp(&(b->list_[i].addr_.addr_), &(e->addrs_[j].addr_), e->addrs_[j].len_)) {
+        b->list_[i].stale_ = 0;
+        break;
+      }
+    }
+  }
+
+  int ret = 0;
+  for(j = 0; j < e->len_ && !ret; ++j) {
+    i = backends_find(b, &(e->addrs_[j]));
+    if(i < 0)
+      ret = backends_append(b, &(e->addrs_[j]), group);
+    else if(b->list_[i].stale_) {
+      b->list_[i].group_ = group;
+      b->list_[i].weight_ = b->remotes_[group].weight_;
+      b->list_[i].stale_ = 0;
+    }
+  }
+  b->table_dirty_ = 1;
+  return ret;
+}
+
+void backends_resolved(resolver_entry_t* e)
+{
+  backends_t* b;
+  for(b = backends_first; b; b = b->next_set_) {
+    int i;
+    for(i = 0; i < b->num_remotes_; ++i) {
+      if(b->remotes_[i].entry_ == e && backends_sync(b, i))
+        log_printf(ERROR, "unable to update backends of %s:%s", e->name_, e->service_ ? e->service_ : "0");
+    }
+  }
+}
+
+int backends_usable(backends_t* b)
+{
+  int i, cnt = 0;
+  for(i = 0; b && i < b->len_; ++i)
+    if(!b->list_[i].stale_)
+      cnt++;
+  return cnt;
+}
+
+static int backends_grow_sources(backends_t* b, int num)
+{
+  if(b->num_sources_ + num > BACKEND_MAX_SOURCES) {
+    log_printf(ERROR, "too many source addresses, at most %d are supported", BACKEND_MAX_SOURCES);
+    return -1;
+  }
+  backend_source_t* sources = realloc(b->sources_, (b->num_sources_ + num) * sizeof(backend_source_t));
+  if(!sources)
+    return -2;
+  b->sources_ = sources;
+  return 0;
+}
+
+/* adds a single address or every address of a network given as addr/prefix,
+   for IPv6 only the last 16 bits may vary. The network and broadcast
+   addresses of IPv4 networks larger than /31 are left out. */
+static int backends_add_source(backends_t* b, char* spec, resolv_type_t rrt)
+{
+  long prefix = -1;
+  char* slash = strchr(spec, '/');
+  if(slash) {
+    *slash = 0;
+    char* end;
+    errno = 0;
+    prefix = strtol(slash + 1, &end, 10);
+    if(errno || end == slash + 1 || *end || prefix < 0 || prefix > 128) {
+      log_printf(ERROR, "illegal prefix length '%s' for source address %s", slash + 1, spec);
+      return -1;
+    }
+  }
+
+  resolver_entry_t* se = resolver_lookup(spec, NULL, rrt, RESOLVER_NO_BACKGROUND);
+  if(!se)
+    return -1;
+
+  tcp_endpoint_t base = se->addrs_[0];
+  int ret = 0;
+  int bits = base.addr_.ss_family == AF_INET6 ? 128 : 32;
+  if(prefix < 0)
+    prefix = bits;
+  if(b->num_sources_ && base.addr_.ss_family != b->sources_[0].addr_.addr_.ss_family) {
+    log_printf(ERROR, "source address %s is not of the same protocol family as the others", spec);
+    ret = -1;
+  } else if(prefix > bits) {
+    log_printf(ERROR, "illegal prefix length /%ld for source address %s, at most /%d is allowed", prefix, spec, bits);
+    ret = -1;
+  } else if(bits - prefix > 16) {
+    log_printf(ERROR, "illegal prefix length /%ld for source address %s, at most 16 host bits are supported", prefix, spec);
+    ret = -1;
+  }
+  if(ret) {
+    resolver_release(se);
+    return ret;
+  }
+
+  int num = 1 << (bits - prefix);
+  int first = 0, last = num - 1;
+  if(base.addr_.ss_family == AF_INET && prefix < 31) {
+    first++;
+    last--;
+  }
+  ret = backends_grow_sources(b, last - first + 1);
+  if(ret) {
+    resolver_release(se);
+    return ret;
+  }
+
+  u_int32_t mask = (u_int32_t)(num - 1);
+  int i;
+  for(i = first; i <= last; ++i) {
+    backend_source_t* s = &(b->sources_[b->num_sources_++]);
+    s->addr_ = base;
+    s->entry_ = resolver_ref(se);
+    s->conns_ = 0;
+    if(base.addr_.ss_family == AF_INET6) {
+      u_int8_t* a = ((struct sockaddr_in6*)&(s->addr_.addr_))->sin6_addr.s6_addr;
+      u_int32_t low = (((a[14] << 8) | a[15]) & ~mask & 0xFFFF) | i;
+      a[14] = (low >> 8) & 0xFF;
+      a[15] = low & 0xFF;
+    } else {
+      struct in_addr* a = &(((struct sockaddr_in*)&(s->addr_.addr_))->sin_addr);
+      a->s_addr = htonl((ntohl(a->s_addr) & ~mask) | i);
+    }
+  }
+  resolver_release(se);
+  return 0;
+}
+
+static void backends_clear_sources(backends_t* b)
+{
+  int i;
+  for(i = 0; i < b->num_sources_; ++i)
+    resolver_release(b->sources_[i].entry_);
+  b->num_sources_ = 0;
+}
+
+/* saddr is a comma separated list of addresses, hostnames or networks,
+   connections to the backends are spread over all of them */
+int backends_set_source(backends_t* b, const char* saddr, resolv_type_t rrt)
+{
+  if(!b || !saddr)
+    return -1;
+
+  char* list = strdup(saddr);
+  if(!list)
+    return -2;
+
+  backends_clear_sources(b);
+  int ret = 0;
+  char* save = NULL;
+  char* spec;
+  for(spec = strtok_r(list, ", \t", &save); spec && !ret; spec = strtok_r(NULL, ", \t", &save))
+    ret = backends_add_source(b, spec, rrt);
+  free(list);
+  if(!ret && !b->num_sources_)
+    ret = -1;
+  if(ret) {
+    backends_clear_sources(b);
+    return ret;
+  }
+
+  b->source_end_ = b->sources_[0].addr_;
+  return 0;
+}
+
+/* of the next two source addresses in turn the one with fewer connections
+   is used, this spreads the connections evenly even if some of them last
+   much longer than others. avoid is a source which just ran out of ports */
+int backends_source_acquire(backends_t* b, int avoid)
+{
+  if(!b || !b->num_sources_)
+    return -1;
+
+  int i = b->next_source_++ % b->num_sources_;
+  int j = (i + 1) % b->num_sources_;
+  if(i == avoid || (j != avoid && b->sources_[j].conns_ < b->sources_[i].conns_))
+    i = j;
+  b->sources_[i].conns_++;
+  return i;
+}
+
+void backends_source_release(backends_t* b, int source)
+{
+  if(!b || source < 0 || source >= b->num_sources_)
+    return;
+
+  if(b->sources_[source].conns_)
+    b->sources_[source].conns_--;
+}
+
+char* backends_source_to_string(backends_t* b)
+{
+  if(!b || !b->num_sources_)
+    return NULL;
+
+  char* first = tcp_endpoint_to_string(b->sources_[0].addr_);
+  if(!first || b->num_sources_ == 1)
+    return first;
+
+  char* ret = NULL;
+  if(asprintf(&ret, "%s (+%d more)", first, b->num_sources_ - 1) == -1)
+    ret = NULL;
+  free(first);
+  return ret;
+}
+
+void backends_set_health(backends_t* b, const backend_health_t health)
+{
+  if(!b)
+    return;
+
+  b->health_ = health;
+  if(!backends_poller)
+    return;
+  if(health.interval_)
+    timer_wheel_set(&backends_timers, &(b->probe_timer_), timer_wheel_now(&backends_timers));
+  else
+    timer_wheel_cancel(&backends_timers, &(b->probe_timer_));
+}
+
+void backends_set_preconnect(backends_t* b, int preconnect)
+{
+  if(!b)
+    return;
+
+  int i;
+  for(i = 0; i < b->len_; ++i)
+    backends_spares_clear(b, &(b->list_[i]));
+  b->preconnect_ = preconnect > 0 ? preconnect : 0;
+  if(!backends_poller)
+    return;
+  if(b->preconnect_)
+    timer_wheel_set(&backends_timers, &(b->spare_timer_), timer_wheel_now(&backends_timers));
+  else
+    timer_wheel_cancel(&backends_timers, &(b->spare_timer_));
+}
+
+int backends_add(backends_t* b, const char* addr, const char* port, resolv_type_t rrt, int weight)
+{
+  if(!b)
+    return -1;
+
+  if(!addr) { log_printf(ERROR, "no remote address specified"); return -1; }
+  if(!port) { log_printf(ERROR, "no remote port specified"); return -1; }
+  if(weight <= 0) {
+    log_printf(WARNING, "illegal weight %d for remote %s:%s, using 1", weight, addr, port);
+    weight = 1;
+  }
+
+  backend_remote_t* remotes = realloc(b->remotes_, (b->num_remotes_ + 1) * sizeof(backend_remote_t));
+  if(!remotes)
+    return -2;
+  b->remotes_ = remotes;
+
+  resolver_entry_t* e = resolver_lookup(addr, port, rrt, 0);
+  if(!e)
+    return -1;
+
+  int group = b->num_remotes_++;
+  b->remotes_[group].entry_ = e;
+  b->remotes_[group].weight_ = weight;
+  return backends_sync(b, group);
+}
+
+static int backend_usable(backends_t* b, int idx, int family)
+{
+  if(b->list_[idx].stale_)
+    return 0;
+  return family == AF_UNSPEC || b->list_[idx].addr_.addr_.ss_family == family;
+}
+
+int backends_ejected(backends_t* b, int idx)
+{
+  backend_t* be = &(b->list_[idx]);
+  if(!be->ejected_until_)
+    return 0;
+
+  /* with active health checks only a successful probe ends the ejection */
+  if(b->health_.interval_ || timer_wheel_now(&backends_timers) < be->ejected_until_)
+    return 1;
+
+  be->recovered_at_ = be->ejected_until_;
+  be->ejected_until_ = 0;
+  return 0;
+}
+
+static int backend_available(backends_t* b, int idx, int family, int exclude, int panic)
+{
+  if(exclude >= 0 && b->list_[idx].group_ == exclude)
+    return 0;
+  return backend_usable(b, idx, family) && (panic || !backends_ejected(b, idx));
+}
+
+/* a backend which just recovered gets a weight growing linearly from
+   almost nothing to its configured weight during the slow start period */
+static int backend_weight(backends_t* b, int idx)
+{
+  backend_t* be = &(b->list_[idx]);
+  int weight = be->weight_ * 100;
+  if(!be->recovered_at_)
+    return weight;
+
+  u_int64_t elapsed = timer_wheel_now(&backends_timers) - be->recovered_at_;
+  if(!b->health_.slow_start_ || elapsed >= b->health_.slow_start_) {
+    be->recovered_at_ = 0;
+    return weight;
+  }
+  weight = (int)((u_int64_t)weight * elapsed / b->health_.slow_start_);
+  return weight > 0 ? weight : 1;
+}
+
+static int backends_select_round_robin(backends_t* b, int family, int exclude, int panic)
+{
+  int i;
+  for(i = 0; i < b->len_; ++i) {
+    int idx = (b->next_ + i) % b->len_;
+    if(backend_available(b, idx, family, exclude, panic)) {
+      b->next_ = (idx + 1) % b->len_;
+      return idx;
+    }
+  }
+  return -1;
+}
+
+/* smooth weighted round robin: every backend gains its weight on each
+   pick and the winner pays back the total, which interleaves picks
+   instead of sending runs of requests to the heaviest backend */
+static int backends_select_weighted(backends_t* b, int family, int exclude, int panic)
+{
+  int i, best = -1, total = 0;
+  for(i = 0; i < b->len_; ++i) {
+    if(!backend_available(b, i, family, exclude, panic))
+      continue;
+    int weight = backend_weight(b, i);
+    b->list_[i].current_weight_ += weight;
+    total += weight;
+    if(best < 0 || b->list_[i].current_weight_ > b->list_[best].current_weight_)
+      best = i;
+  }
+  if(best >= 0)
+    b->list_[best].current_weight_ -= total;
+  return best;
+}
+
+static int backends_select_least_conn(backends_t* b, int family, int exclude, int panic)
+{
+  int i, best = -1, best_weight = 0;
+  for(i = 0; i < b->len_; ++i) {
+    int idx = (b->next_ + i) % b->len_;
+    if(!backend_available(b, idx, family, exclude, panic))
+      continue;
+    int weight = backend_weight(b, idx);
+    if(best < 0 || (int64_t)b->list_[idx].active_ * best_weight < (int64_t)b->list_[best].active_ * weight) {
+      best = idx;
+      best_weight = weight;
+    }
+  }
+  if(best >= 0)
+    b->next_ = (best + 1) % b->len_;
+  return best;
+}
+
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+static u_int32_t backend_hash_bytes(u_int32_t h, const void* data, size_t len)
+{
+  const unsigned char* p = data;
+  size_t i;
+  for(i = 0; i < len; ++i) {
+    h ^= p[i];
+    h *= FNV_PRIME;
+  }
+  return h;
+}
+
+static u_int32_t backend_hash_endpoint(const tcp_endpoint_t* e, int port, u_int32_t h)
+{
+  switch(e->addr_.ss_family) {
+  case AF_INET: {
+    const struct sockaddr_in* sin = (const struct sockaddr_in*)&(e->addr_);
+    h = backend_hash_bytes(h, &(sin->sin_addr), sizeof(sin->sin_addr));
+    return port ? backend_hash_bytes(h, &(sin->sin_port), sizeof(sin->sin_port)) : h;
+  }
+  case AF_INET6: {
+    const struct sockaddr_in6* sin6 = (const struct sockaddr_in6*)&(e->addr_);
+    h = backend_hash_bytes(h, &(sin6->sin6_addr), sizeof(sin6->sin6_addr));
+    return port ? backend_hash_bytes(h, &(sin6->sin6_port), sizeof(sin6->sin6_port)) : h;
+  }
+  }
+  return h;
+}
+
+u_int32_t backends_hash(const tcp_endpoint_t* peer)
+{
+  if(!peer)
+    return 0;
+  return backend_hash_endpoint(peer, 0, FNV_OFFSET_BASIS);
+}
+
+/* builds the Maglev lookup table (Eisenbud et al., NSDI 2016): every backend
+   walks the table in its own order given by offset and skip which only depend
+   on its address and claims the next free slot in turn, so adding or removing
+   a backend moves few slots. Backends get turns in proportion to their weight */
+static int backends_build_table(backends_t* b)
+{
+  if(!b->table_) {
+    b->table_ = malloc(BACKEND_MAGLEV_SIZE * sizeof(int));
+    if(!b->table_)
+      return -2;
+  }
+  b->table_dirty_ = 0;
+
+  int i;
+  for(i = 0; i < BACKEND_MAGLEV_SIZE; ++i)
+    b->table_[i] = -1;
+
+  int max_weight = 0;
+  for(i = 0; i < b->len_; ++i)
+    if(!b->list_[i].stale_ && b->list_[i].weight_ > max_weight)
+      max_weight = b->list_[i].weight_;
+  if(!max_weight)
+    return 0;
+
+  u_int32_t* perm = malloc(b->len_ * 4 * sizeof(u_int32_t));
+  if(!perm) {
+    free(b->table_);
+    b->table_ = NULL;
+    return -2;
+  }
+  for(i = 0; i < b->len_; ++i) {
+    u_int32_t* p = &(perm[i * 4]);
+    p[0] = backend_hash_endpoint(&(b->list_[i].addr_), 1, FNV_OFFSET_BASIS) % BACKEND_MAGLEV_SIZE;
+    p[1] = backend_hash_endpoint(&(b->list_[i].addr_), 1, 0x9e3779b9u) % (BACKEND_MAGLEV_SIZE - 1) + 1;
+    p[2] = 0;
+    p[3] = 0;
+  }
+
+  int filled = 0;
+  while(filled < BACKEND_MAGLEV_SIZE) {
+    for(i = 0; i < b->len_ && filled < BACKEND_MAGLEV_SIZE; ++i) {
+      if(b->list_[i].stale_)
+        continue;
+      u_int32_t* p = &(perm[i * 4]);
+      p[3] += b->list_[i].weight_;
+      if(p[3] < (u_int32_t)max_weight)
+        continue;
+      p[3] -= max_weight;
+
+      u_int32_t slot;
+      do {
+        slot = (u_int32_t)((p[0] + (u_int64_t)p[2] * p[1]) % BACKEND_MAGLEV_SIZE);
+        p[2]++;
+      } while(b->table_[slot] >= 0);
+      b->table_[slot] = i;
+      filled++;
+    }
+  }
+  free(perm);
+  return 0;
+}
+
+/* clients of an ejected or excluded backend move on to the next slots of
+   the table, which spreads them over the others without moving anybody else */
+static int backends_select_hash(backends_t* b, int family, int exclude, u_int32_t hash, int panic)
+{
+  if(!b->table_)
+    return backends_select_round_robin(b, family, exclude, panic);
+
+  int i;
+  for(i = 0; i < BACKEND_MAGLEV_SIZE; ++i) {
+    int idx = b->table_[(hash + (u_int32_t)i) % BACKEND_MAGLEV_SIZE];
+    if(idx >= 0 && backend_available(b, idx, family, exclude, panic))
+      return idx;
+  }
+  return -1;
+}
+
+static int backends_slow_starting(backends_t* b)
+{
+  int i;
+  for(i = 0; i < b->len_; ++i)
+    if(b->list_[i].recovered_at_ && !b->list_[i].stale_)
+      return 1;
+  return 0;
+}
+
+static int backends_select_panic(backends_t* b, int family, int exclude, u_int32_t hash, int panic)
+{
+  switch(b->balance_) {
+  case BALANCE_ROUND_ROBIN:
+    if(!backends_slow_starting(b))
+      return backends_select_round_robin(b, family, exclude, panic);
+    return backends_select_weighted(b, family, exclude, panic);
+  case BALANCE_WEIGHTED: return backends_select_weighted(b, family, exclude, panic);
+  case BALANCE_LEAST_CONN: return backends_select_least_conn(b, family, exclude, panic);
+  case BALANCE_HASH_SOURCE: return backends_select_hash(b, family, exclude, hash, panic);
+  }
+  return -1;
+}
+
+/* exclude names a remote whose addresses should not be picked, if there is
+   no other remote the excluded one is used anyway */
+int backends_select(backends_t* b, int family, int exclude, u_int32_t hash)
+{
+  if(!b || !b->len_)
+    return -1;
+
+  if(b->balance_ == BALANCE_HASH_SOURCE && b->table_dirty_ && backends_build_table(b))
+    log_printf(WARNING, "unable to build the lookup table for hash-source balancing, using round-robin");
+
+  int idx = backends_select_panic(b, family, exclude, hash, 0);
+  if(idx < 0) {
+    /* all backends are ejected, rather try one of them than refusing everybody */
+    idx = backends_select_panic(b, family, exclude, hash, 1);
+    if(idx >= 0)
+      log_printf(DEBUG, "all backends are ejected, using one anyway");
+  }
+  if(idx < 0 && exclude >= 0)
+    return backends_select(b, family, -1, hash);
+  if(idx >= 0)
+    b->list_[idx].active_++;
+  return idx;
+}
+
+void backends_acquire(backends_t* b, int idx)
+{
+  if(!b || idx < 0 || idx >= b->len_)
+    return;
+
+  b->list_[idx].active_++;
+}
+
+void backends_release(backends_t* b, int idx)
+{
+  if(!b || idx < 0 || idx >= b->len_)
+    return;
+
+  if(b->list_[idx].active_ > 0)
+    b->list_[idx].active_--;
+}
+
+static int backends_nth_of_family(backends_t* b, int first, int family, int same, int n)
+{
+  if(same && !n--)
+    return first;
+
+  int i;
+  for(i = 0; i < b->len_; ++i) {
+    if(i == first || b->list_[i].group_ != b->list_[first].group_ || !backend_usable(b, i, family))
+      continue;
+    if((b->list_[i].addr_.addr_.ss_family == b->list_[first].addr_.addr_.ss_family) != same)
+      continue;
+    if(!n--)
+      return i;
+  }
+  return -1;
+}
+
+/* returns the n-th address to try when connecting to backend first: all
+   addresses which were resolved from the same remote, starting with first
+   and alternating between the address families as described in RFC 8305 */
+int backends_candidate(backends_t* b, int first, int family, int n)
+{
+  if(!b || first < 0 || first >= b->len_ || n < 0)
+    return -1;
+
+  int i, same = 0, other = 0;
+  for(i = 0; i < b->len_; ++i) {
+    if(b->list_[i].group_ != b->list_[first].group_ || !backend_usable(b, i, family))
+      continue;
+    if(b->list_[i].addr_.addr_.ss_family == b->list_[first].addr_.addr_.ss_family)
+      same++;
+    else
+      other++;
+  }
+
+  int pairs = same < other ? same : other;
+  if(n < 2 * pairs)
+    return backends_nth_of_family(b, first, family, !(n % 2), n / 2);
+  if(n >= same + other)
+    return -1;
+  return backends_nth_of_family(b, first, family, same > other, n - pairs);
+}
+
+char* backends_to_string(backends_t* b)
+{
+  if(!b)
+    return NULL;
+
+  char* ret = strdup("");
+  int i;
+  for(i = 0; ret && i < b->len_; ++i) {
+    if(b->list_[i].stale_)
+      continue;
+    char* s = tcp_endpoint_to_string(b->list_[i].addr_);
+    char* tmp = NULL;
+    int len;
+    if(b->balance_ == BALANCE_ROUND_ROBIN)
+      len = asprintf(&tmp, "%s%s%s", ret, *ret ? ", " : "", s ? s : "(null)");
+    else
+      len = asprintf(&tmp, "%s%s%s (weight %d)", ret, *ret ? ", " : "", s ? s : "(null)", b->list_[i].weight_);
+    if(s) free(s);
+    free(ret);
+    ret = len == -1 ? NULL : tmp;
+  }
+  return ret;
+}
+
+const char* balance_type_to_string(balance_type_t balance)
+{
+  switch(balance) {
+  case BALANCE_ROUND_ROBIN: return "round-robin";
+  case BALANCE_WEIGHTED: return "weighted";
+  case BALANCE_LEAST_CONN: return "least-conn";
+  case BALANCE_HASH_SOURCE: return "hash-source";
+  }
+  return "unknown";
+}
+
+static char* backend_to_string(backend_t* be)
+{
+  return tcp_endpoint_to_string(be->addr_);
+}
+
+void backends_report(backends_t* b, int idx, int ok)
+{
+  if(!b || idx < 0 || idx >= b->len_)
+    return;
+
+  backend_t* be = &(b->list_[idx]);
+  u_int64_t now = timer_wheel_now(&backends_timers);
+  if(ok) {
+    if(be->ejected_until_) {
+      char* rs = backend_to_string(be);
+      log_printf(NOTICE, "backend %s is healthy again", rs ? rs : "(null)");
+      if(rs) free(rs);
+      be->ejected_until_ = 0;
+      be->recovered_at_ = now;
+    }
+    be->failures_ = 0;
+    be->ejections_ = 0;
+    return;
+  }
+
+  be->connect_failures_++;
+  be->failures_++;
+  if(!b->health_.max_fails_ || be->failures_ < b->health_.max_fails_ || backends_ejected(b, idx))
+    return;
+
+  int shift = be->ejections_ < BACKEND_MAX_BACKOFF ? be->ejections_ : BACKEND_MAX_BACKOFF;
+  u_int64_t backoff = (u_int64_t)b->health_.fail_timeout_ << shift;
+  char* rs = backend_to_string(be);
+  log_printf(WARNING, "backend %s failed %d times in a row, ejecting it for %llus", rs ? rs : "(null)", be->failures_,
+             (unsigned long long)(backoff + 999) / 1000);
+  if(rs) free(rs);
+  be->ejected_until_ = now + backoff;
+  be->recovered_at_ = 0;
+  be->ejections_++;
+  be->failures_ = 0;
+}
+
+static void backends_probe_done(backends_t* b, int idx, int error)
+{
+  backend_t* be = &(b->list_[idx]);
+  backends_probe_stop(be);
+  if(error) {
+    char* rs = backend_to_string(be);
+    log_printf(INFO, "health check of backend %s failed: %s", rs ? rs : "(null)", strerror(error));
+    if(rs) free(rs);
+  }
+  backends_report(b, idx, !error);
+}
+
+static void backends_probe_start(backends_t* b, int idx)
+{
+  backend_t* be = &(b->list_[idx]);
+  int fd = socket(be->addr_.addr_.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if(fd < 0) {
+    log_printf(WARNING, "unable to start health check: %s", strerror(errno));
+    return;
+  }
+  if(b->source_end_.addr_.ss_family == be->addr_.addr_.ss_family &&
+     tcp_bind_source(fd, &(b->source_end_)) < 0) {
+    log_printf(WARNING, "unable to start health check, error on bind(): %s", strerror(errno));
+    close(fd);
+    return;
+  }
+  if(backends_map_fd(fd, b, idx, -1)) {
+    log_printf(ERROR, "unable to start health check: memory error");
+    close(fd);
+    return;
+  }
+
+  be->probe_fd_ = fd;
+  backends_probing++;
+  if(!connect(fd, (struct sockaddr *)&(be->addr_.addr_), be->addr_.len_)) {
+    backends_probe_done(b, idx, 0);
+    return;
+  }
+  if(errno != EINPROGRESS) {
+    backends_probe_done(b, idx, errno);
+    return;
+  }
+  if(poller_set(backends_poller, fd, POLLER_WRITE)) {
+    log_printf(ERROR, "unable to add health check %d to event loop", fd);
+    backends_probe_stop(be);
+  }
+}
+
+static void backends_probe_round(backends_t* b)
+{
+  int i;
+  for(i = 0; i < b->len_; ++i) {
+    if(b->list_[i].stale_)
+      continue;
+    if(b->list_[i].probe_fd_ >= 0)
+      backends_probe_done(b, i, ETIMEDOUT);
+    backends_probe_start(b, i);
+  }
+  timer_wheel_set(&backends_timers, &(b->probe_timer_), timer_wheel_now(&backends_timers) + b->health_.interval_);
+}
+
+/* preconnected sockets double as health checks, their outcome is reported
+   like that of a client connection */
+static void backends_spare_done(backends_t* b, int idx, backend_spare_t* s, int error)
+{
+  if(error) {
+    backends_spare_close(b, s);
+    char* rs = backend_to_string(&(b->list_[idx]));
+    log_printf(INFO, "preconnecting to backend %s failed: %s", rs ? rs : "(null)", strerror(error));
+    if(rs) free(rs);
+    backends_report(b, idx, 0);
+    return;
+  }
+
+  s->established_ = 1;
+  s->since_ = timer_wheel_now(&backends_timers);
+  if(poller_set(backends_poller, s->fd_, POLLER_READ)) {
+    log_printf(ERROR, "unable to add preconnected socket %d to event loop", s->fd_);
+    backends_spare_close(b, s);
+  }
+  backends_report(b, idx, 1);
+}
+
+static void backends_spare_start(backends_t* b, int idx, backend_spare_t* s)
+{
+  backend_t* be = &(b->list_[idx]);
+  int fd = socket(be->addr_.addr_.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if(fd < 0) {
+    log_printf(WARNING, "unable to preconnect: %s", strerror(errno));
+    return;
+  }
+  tcp_set_sockopts(fd, be->addr_.addr_.ss_family, &(b->sockopts_), TCP_SOCKOPTS_BUFFERS | TCP_SOCKOPTS_CONNECTION);
+  int source = backends_source_acquire(b, -1);
+  if(source >= 0 && tcp_bind_source(fd, &(b->sources_[source].addr_)) < 0) {
+    log_printf(WARNING, "unable to preconnect, error on bind(): %s", strerror(errno));
+    backends_source_release(b, source);
+    close(fd);
+    return;
+  }
+  if(backends_map_fd(fd, b, idx, s - be->spares_)) {
+    log_printf(ERROR, "unable to preconnect: memory error");
+    backends_source_release(b, source);
+    close(fd);
+    return;
+  }
+
+  s->fd_ = fd;
+  s->source_ = source;
+  s->established_ = 0;
+  s->since_ = timer_wheel_now(&backends_timers);
+  backends_spares++;
+  if(!connect(fd, (struct sockaddr *)&(be->addr_.addr_), be->addr_.len_)) {
+    backends_spare_done(b, idx, s, 0);
+    return;
+  }
+  if(errno != EINPROGRESS) {
+    backends_spare_done(b, idx, s, errno);
+    return;
+  }
+  if(poller_set(backends_poller, fd, POLLER_WRITE)) {
+    log_printf(ERROR, "unable to add preconnected socket %d to event loop", fd);
+    backends_spare_close(b, s);
+  }
+}
+
+/* an idle connection which became readable was either closed by the backend
+   or got a greeting which the client will receive once it takes over */
+static int backends_spare_alive(backend_spare_t* s)
+{
+  char c;
+  int len = recv(s->fd_, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  return len > 0 || (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+static void backends_spare_fill(backends_t* b, int idx)
+{
+  backend_t* be = &(b->list_[idx]);
+  if(be->stale_ || (b->source_end_.addr_.ss_family != AF_UNSPEC && b->source_end_.addr_.ss_family != be->addr_.addr_.ss_family)) {
+    backends_spares_clear(b, be);
+    return;
+  }
+
+  int i;
+  if(!be->spares_) {
+    be->spares_ = malloc(b->preconnect_ * sizeof(backend_spare_t));
+    if(!be->spares_)
+      return;
+    for(i = 0; i < b->preconnect_; ++i) {
+      be->spares_[i].fd_ = -1;
+      be->spares_[i].source_ = -1;
+      be->spares_[i].established_ = 0;
+    }
+  }
+
+  u_int64_t now = timer_wheel_now(&backends_timers);
+  for(i = 0; i < b->preconnect_ && be->spares_; ++i) {
+    backend_spare_t* s = &(be->spares_[i]);
+    if(s->fd_ >= 0 && !s->established_ && now - s->since_ >= BACKEND_SPARE_CONNECT_TIMEOUT)
+      backends_spare_done(b, idx, s, ETIMEDOUT);
+    if(s->fd_ < 0 && !backends_ejected(b, idx))
+      backends_spare_start(b, idx, s);
+  }
+}
+
+static void backends_spare_round(backends_t* b)
+{
+  int i;
+  for(i = 0; i < b->len_; ++i)
+    backends_spare_fill(b, i);
+  timer_wheel_set(&backends_timers, &(b->spare_timer_), timer_wheel_now(&backends_timers) + BACKEND_SPARE_INTERVAL);
+}
+
+/* the socket keeps counting towards the source address it is bound to,
+   the caller has to release that once it is done with the socket */
+int backends_take_spare(backends_t* b, int idx, int* source)
+{
+  if(!b || idx < 0 || idx >= b->len_ || !b->list_[idx].spares_)
+    return -1;
+
+  backend_t* be = &(b->list_[idx]);
+  int i, fd = -1;
+  for(i = 0; i < b->preconnect_ && fd < 0; ++i) {
+    backend_spare_t* s = &(be->spares_[i]);
+    if(s->fd_ < 0 || !s->established_)
+      continue;
+    if(!backends_spare_alive(s)) {
+      backends_spare_close(b, s);
+      continue;
+    }
+    poller_set(backends_poller, s->fd_, 0);
+    backends_unmap_fd(s->fd_);
+    fd = s->fd_;
+    *source = s->source_;
+    s->fd_ = -1;
+    s->source_ = -1;
+    s->established_ = 0;
+    backends_spares--;
+  }
+  if(fd >= 0)
+    backends_spare_fill(b, idx);
+  return fd;
+}
+
+int backends_spares_ready(backends_t* b, int idx)
+{
+  if(!b || idx < 0 || idx >= b->len_ || !b->list_[idx].spares_)
+    return 0;
+
+  int i, cnt = 0;
+  for(i = 0; i < b->preconnect_; ++i)
+    if(b->list_[idx].spares_[i].established_)
+      cnt++;
+  return cnt;
+}
+
+static void backends_timeout(timer_entry_t* t, void* ctx)
+{
+  backends_t* b = (backends_t*)t->data_;
+  if(t == &(b->spare_timer_))
+    backends_spare_round(b);
+  else
+    backends_probe_round(b);
+}
+
+void backends_set_poller(poller_t* poller)
+{
+  backends_t* b;
+  int i;
+  for(b = backends_first; b; b = b->next_set_) {
+    timer_wheel_cancel(&backends_timers, &(b->probe_timer_));
+    timer_wheel_cancel(&backends_timers, &(b->spare_timer_));
+    for(i = 0; i < b->len_; ++i) {
+      backends_probe_stop(&(b->list_[i]));
+      backends_spares_clear(b, &(b->list_[i]));
+    }
+  }
+
+  backends_poller = poller;
+  if(!poller) {
+    if(backends_fds)
+      free(backends_fds);
+    backends_fds = NULL;
+    backends_fds_len = 0;
+    return;
+  }
+
+  timer_wheel_init(&backends_timers);
+  for(b = backends_first; b; b = b->next_set_) {
+    if(b->health_.interval_)
+      timer_wheel_set(&backends_timers, &(b->probe_timer_), timer_wheel_now(&backends_timers));
+    if(b->preconnect_)
+      timer_wheel_set(&backends_timers, &(b->spare_timer_), timer_wheel_now(&backends_timers));
+  }
+}
+
+int backends_next_timeout()
+{
+  if(!backends_poller)
+    return -1;
+
+  return timer_wheel_next(&backends_timers);
+}
+
+void backends_handle_timeouts()
+{
+  if(!backends_poller)
+    return;
+
+  timer_wheel_advance(&backends_timers, backends_timeout, NULL);
+}
+
+static void backends_spare_ready(backends_t* b, int idx, backend_spare_t* s)
+{
+  if(s->established_) {
+    if(backends_spare_alive(s))
+      poller_set(backends_poller, s->fd_, 0);
+    else
+      backends_spare_close(b, s);
+    return;
+  }
+  int error = 0;
+  socklen_t len = sizeof(error);
+  if(getsockopt(s->fd_, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+    error = errno;
+  backends_spare_done(b, idx, s, error);
+}
+
+void backends_handle_ready()
+{
+  if(!backends_poller || (!backends_probing && !backends_spares))
+    return;
+
+  int i, num = poller_num_reported(backends_poller);
+  for(i = 0; i < num; ++i) {
+    int fd = poller_get_reported(backends_poller, i);
+    if(fd < 0 || fd >= backends_fds_len || !backends_fds[fd].set_ || !poller_ready(backends_poller, fd))
+      continue;
+
+    backends_t* b = backends_fds[fd].set_;
+    int idx = backends_fds[fd].idx_;
+    backend_t* be = &(b->list_[idx]);
+    if(backends_fds[fd].spare_ >= 0) {
+      backends_spare_ready(b, idx, &(be->spares_[backends_fds[fd].spare_]));
+      continue;
+    }
+    if(!(poller_ready(backends_poller, fd) & POLLER_WRITE))
+      continue;
+
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+      error = errno;
+    backends_probe_done(b, idx, error);
+  }
+}
@@ -0,0 +1,151 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCPPROXY_backend_h_INCLUDED
+#define TCPPROXY_backend_h_INCLUDED
+
+#include "tcp.h"
+#include "poller.h"
+#include "resolver.h"
+#include "timer_wheel.h"
+
+#define BACKEND_DEFAULT_MAX_FAILS 3
+#define BACKEND_DEFAULT_FAIL_TIMEOUT 10
+#define BACKEND_MAX_BACKOFF 6
+#define BACKEND_DEFAULT_RETRIES 2
+#define BACKEND_MAGLEV_SIZE 65537
+#define BACKEND_SPARE_INTERVAL 1000
+#define BACKEND_SPARE_CONNECT_TIMEOUT 5000
+#define BACKEND_MAX_SOURCES 65536
+
+enum balance_type_enum { BALANCE_ROUND_ROBIN, BALANCE_WEIGHTED, BALANCE_LEAST_CONN, BALANCE_HASH_SOURCE };
+typedef enum balance_type_enum balance_type_t;
+
+typedef struct {
+  int max_fails_;
+  u_int32_t fail_timeout_;
+  u_int32_t interval_;
+  u_int32_t slow_start_;
+} backend_health_t;
+
+typedef struct {
+  int fd_;
+  int source_;
+  int established_;
+  u_int64_t since_;
+} backend_spare_t;
+
+typedef struct {
+  struct backends_struct* set_;
+  int idx_;
+  int spare_;
+} backend_fd_t;
+
+typedef struct {
+  tcp_endpoint_t addr_;
+  resolver_entry_t* entry_;
+  u_int32_t conns_;
+} backend_source_t;
+
+typedef struct {
+  tcp_endpoint_t addr_;
+  int group_;
+  int weight_;
+  int current_weight_;
+  int active_;
+  int stale_;
+  int failures_;
+  u_int64_t connect_failures_;
+  int ejections_;
+  u_int64_t ejected_until_;
+  u_int64_t recovered_at_;
+  int probe_fd_;
+  backend_spare_t* spares_;
+} backend_t;
+
+typedef struct {
+  resolver_entry_t* entry_;
+  int weight_;
+} backend_remote_t;
+
+struct backends_struct {
+  backend_t* list_;
+  int len_;
+  int size_;
+  backend_remote_t* remotes_;
+  int num_remotes_;
+  tcp_endpoint_t source_end_;
+  backend_source_t* sources_;
+  int num_sources_;
+  u_int32_t next_source_;
+  balance_type_t balance_;
+  int* table_;
+  int table_dirty_;
+  backend_health_t health_;
+  int retries_;
+  int preconnect_;
+  int defer_connect_;
+  tcp_sockopts_t sockopts_;
+  timer_entry_t probe_timer_;
+  timer_entry_t spare_timer_;
+  int next_;
+  int refcnt_;
+  struct backends_struct* prev_;
+  struct backends_struct* next_set_;
+};
+typedef struct backends_struct backends_t;
+
+backends_t* backends_new(balance_type_t balance);
+backends_t* backends_ref(backends_t* b);
+void backends_unref(backends_t* b);
+int backends_set_source(backends_t* b, const char* saddr, resolv_type_t rrt);
+int backends_source_acquire(backends_t* b, int avoid);
+void backends_source_release(backends_t* b, int source);
+char* backends_source_to_string(backends_t* b);
+void backends_set_health(backends_t* b, const backend_health_t health);
+void backends_set_preconnect(backends_t* b, int preconnect);
+int backends_add(backends_t* b, const char* addr, const char* port, resolv_type_t rrt, int weight);
+int backends_usable(backends_t* b);
+void backends_resolved(resolver_entry_t* e);
+u_int32_t backends_hash(const tcp_endpoint_t* peer);
+int backends_select(backends_t* b, int family, int exclude, u_int32_t hash);
+void backends_acquire(backends_t* b, int idx);
+void backends_release(backends_t* b, int idx);
+void backends_report(backends_t* b, int idx, int ok);
+int backends_take_spare(backends_t* b, int idx, int* source);
+int backends_spares_ready(backends_t* b, int idx);
+int backends_ejected(backends_t* b, int idx);
+int backends_candidate(backends_t* b, int first, int family, int n);
+char* backends_to_string(backends_t* b);
+const char* balance_type_to_string(balance_type_t balance);
+
+void backends_set_poller(poller_t* poller);
+int backends_next_timeout();
+void backends_handle_timeouts();
+void backends_handle_ready();
+
+#endif
@@ -38,8 +38,15 @@
 #include "log.h"
 #include "options.h"
 #include "tcp.h"
+#include "backend.h"
 #include "listener.h"
 
+struct remote {
+  char* addr_;
+  char* port_;
+  int weight_;
+};
+
 struct listener {
   char* la_;
   resolv_type_t lrt_;
@@ -47,7 +54,20 @@ struct listener {
   char* ra_;
   resolv_type_t rrt_;
   char* rp_;
+  int rw_;
+  struct remote* remotes_;
+  int num_remotes_;
   char* sa_;
+  balance_type_t balance_;
+  relay_type_t relay_;
+  int backlog_;
+  client_timeouts_t timeouts_;
+  backend_health_t health_;
+  int retries_;
+  int preconnect_;
+  int defer_connect_;
+  tcp_sockopts_t client_opts_;
+  tcp_sockopts_t upstream_opts_;
 };
 
 static void init_listener_struct(struct listener* l)
@@ -60,7 +80,25 @@ static void init_listener_struct(struct listener* l)
   l->ra_ = NULL;
   l->rrt_ = ANY;
   l->rp_ = NULL;
+  l->rw_ = 1;
+  l->remotes_ = NULL;
+  l->num_remotes_ = 0;
   l->sa_ = NULL;
+  l->balance_ = BALANCE_ROUND_ROBIN;
+  l->relay_ = RELAY_COPY;
+  l->backlog_ = LISTENER_DEFAULT_BACKLOG;
+  l->timeouts_.connect_ = 0;
+  l->timeouts_.idle_ = 0;
+  l->timeouts_.linger_ = 0;
+  l->health_.max_fails_ = BACKEND_DEFAULT_MAX_FAILS;
+  l->health_.fail_timeout_ = BACKEND_DEFAULT_FAIL_TIMEOUT * 1000;
+  l->health_.interval_ = 0;
+  l->health_.slow_start_ = 0;
+  l->retries_ = BACKEND_DEFAULT_RETRIES;
+  l->preconnect_ = 0;
+  l->defer_connect_ = 0;
+  tcp_sockopts_init(&(l->client_opts_));
+  tcp_sockopts_init(&(l->upstream_opts_));
 }
 
 static void clear_listener_struct(struct listener* l)
@@ -75,6 +113,13 @@ static void clear_listener_struct(struct listener* l)
     free(l->ra_);
   if(l->rp_)
     free(l->rp_);
+  int i;
+  for(i = 0; i < l->num_remotes_; ++i) {
+    free(l->remotes_[i].addr_);
+    free(l->remotes_[i].port_);
+  }
+  if(l->remotes_)
+    free(l->remotes_);
   if(l->sa_)
     free(l->sa_);
 
@@ -98,6 +143,50 @@ static int owrt_string(char** dest, char* start, char* end)
   return 0;
 }
 
+static int add_remote(struct listener* l)
+{
+  if(!l || !l->ra_ || !l->rp_)
+    return -1;
+
+  struct remote* remotes = realloc(l->remotes_, (l->num_remotes_ + 1) * sizeof(struct remote));
+  if(!remotes)
+    return -2;
+
+  l->remotes_ = remotes;
+  l->remotes_[l->num_remotes_].addr_ = l->ra_;
+  l->remotes_[l->num_remotes_].port_ = l->rp_;
+  l->remotes_[l->num_remotes_].weight_ = l->rw_;
+  l->num_remotes_++;
+  l->ra_ = NULL;
+  l->rp_ = NULL;
+  l->rw_ = 1;
+
+  return 0;
+}
+
+static int add_listener(listeners_t* listener, struct listener* l)
+{
+  backends_t* backends = backends_new(l->balance_);
+  if(!backends)
+    return -2;
+  backends_set_health(backends, l->health_);
+  backends->retries_ = l->retries_;
+  backends_set_preconnect(backends, l->preconnect_);
+  backends->defer_connect_ = l->defer_connect_;
+  backends->sockopts_ = l->upstream_opts_;
+
+  int i, ret = 0;
+  for(i = 0; i < l->num_remotes_ && !ret; ++i)
+    ret = backends_add(backends, l->remotes_[i].addr_, l->remotes_[i].port_, l->rrt_, l->remotes_[i].weight_);
+  if(!ret && l->sa_)
+    ret = backends_set_source(backends, l->sa_, l->rrt_);
+  if(!ret)
+    ret = listeners_add(listener, l->la_, l->lrt_, l->lp_, backends, l->relay_, l->backlog_, l->timeouts_, &(l->client_opts_));
+
+  backends_unref(backends);
+  return ret;
+}
+
 %%{
   machine cfg_parser;
 
@@ -108,11 +197,55 @@ static int owrt_string(char** dest, char* start, char* end)
   action set_local_resolv6 { lst.lrt_ = IPV6_ONLY; }
   action set_remote_addr { ret = owrt_string(&(lst.ra_), cpy_start, fpc); cpy_start = NULL; }
   action set_remote_port { ret = owrt_string(&(lst.rp_), cpy_start, fpc); cpy_start = NULL; }
+  action set_remote_weight { lst.rw_ = atoi(cpy_start); cpy_start = NULL; }
+  action add_remote { ret = add_remote(&lst); }
   action set_remote_resolv4 { lst.rrt_ = IPV4_ONLY; }
   action set_remote_resolv6 { lst.rrt_ = IPV6_ONLY; }
   action set_source_addr { ret = owrt_string(&(lst.sa_), cpy_start, fpc); cpy_start = NULL; }
+  action set_balance_round_robin { lst.balance_ = BALANCE_ROUND_ROBIN; }
+  action set_balance_weighted { lst.balance_ = BALANCE_WEIGHTED; }
+  action set_balance_least_conn { lst.balance_ = BALANCE_LEAST_CONN; }
+  action set_balance_hash_source { lst.balance_ = BALANCE_HASH_SOURCE; }
+  action set_relay_copy { lst.relay_ = RELAY_COPY; }
+  action set_relay_splice { lst.relay_ = RELAY_SPLICE; }
+  action set_backlog { lst.backlog_ = atoi(cpy_start); cpy_start = NULL; }
+  action set_connect_timeout { lst.timeouts_.connect_ = atoi(cpy_start) * 1000; cpy_start = NULL; }
+  action set_idle_timeout { lst.timeouts_.idle_ = atoi(cpy_start) * 1000; cpy_start = NULL; }
+  action set_linger_timeout { lst.timeouts_.linger_ = atoi(cpy_start) * 1000; cpy_start = NULL; }
+  action set_connect_retries { lst.retries_ = atoi(cpy_start); cpy_start = NULL; }
+  action set_preconnect { lst.preconnect_ = atoi(cpy_start); cpy_start = NULL; }
+  action set_max_fails { lst.health_.max_fails_ = atoi(cpy_start); cpy_start = NULL; }
+  action set_fail_timeout { lst.health_.fail_timeout_ = atoi(cpy_start) * 1000; cpy_start = NULL; }
+  action set_health_check { lst.health_.interval_ = atoi(cpy_start) * 1000; cpy_start = NULL; }
+  action set_slow_start { lst.health_.slow_start_ = atoi(cpy_start) * 1000; cpy_start = NULL; }
+  action set_defer_connect_on { lst.defer_connect_ = 1; }
+  action set_defer_connect_off { lst.defer_connect_ = 0; }
+  action set_sockopts_client { so = &(lst.client_opts_); }
+  action set_sockopts_upstream { so = &(lst.upstream_opts_); }
+  action set_nodelay_on { so->nodelay_ = 1; }
+  action set_nodelay_off { so->nodelay_ = 0; }
+  action set_rcvbuf { so->rcvbuf_ = atoi(cpy_start); cpy_start = NULL; }
+  action set_sndbuf { so->sndbuf_ = atoi(cpy_start); cpy_start = NULL; }
+  action set_notsent_lowat { so->notsent_lowat_ = atoi(cpy_start); cpy_start = NULL; }
+  action set_keepidle { so->keepidle_ = atoi(cpy_start); cpy_start = NULL; }
+  action set_keepintvl { so->keepintvl_ = atoi(cpy_start); cpy_start = NULL; }
+  action set_keepcnt { so->keepcnt_ = atoi(cpy_start); cpy_start = NULL; }
+  action set_user_timeout { so->user_timeout_ = atoi(cpy_start); cpy_start = NULL; }
+  action set_priority { so->priority_ = atoi(cpy_start); cpy_start = NULL; }
+  action set_fastopen { so->fastopen_ = atoi(cpy_start); cpy_start = NULL; }
+  action set_defer_accept { so->defer_accept_ = atoi(cpy_start); cpy_start = NULL; }
+  action set_tos { so->tos_ = strtol(cpy_start, NULL, 0); cpy_start = NULL; }
+  action set_congestion {
+    if(fpc - cpy_start >= (int)sizeof(so->congestion_)) {
+      log_printf(ERROR, "congestion control algorithm name too long at line %d", cur_line);
+      fgoto *cfg_parser_error;
+    }
+    memcpy(so->congestion_, cpy_start, fpc - cpy_start);
+    so->congestion_[fpc - cpy_start] = 0;
+    cpy_start = NULL;
+  }
   action add_listener {
-    ret = listeners_add(listener, lst.la_, lst.lrt_, lst.lp_, lst.ra_, lst.rrt_, lst.rp_, lst.sa_);
+    ret = add_listener(listener, &lst);
     clear_listener_struct(&lst);
   }
   action logerror {
@@ -136,6 +269,14 @@ static int owrt_string(char** dest, char* start, char* end)
   host_name = [a-zA-Z0-9\-.]+;
   tok_ipv4 = "ipv4"i;
   tok_ipv6 = "ipv6"i;
+  tok_copy = "copy"i;
+  tok_splice = "splice"i;
+  tok_round_robin = "round-robin"i;
+  tok_weighted = "weighted"i;
+  tok_least_conn = "least-conn"i;
+  tok_hash_source = "hash-source"i;
+  tok_on = "on"i;
+  tok_off = "off"i;
 
   host_or_addr = ( host_name | ipv4_addr | ipv6_addr );
   service = ( number | name );
@@ -146,17 +287,76 @@ static int owrt_string(char** dest, char* start, char* end)
 
   remote_addr = host_or_addr >set_cpy_start %set_remote_addr;
   remote_port = service >set_cpy_start %set_remote_port;
+  remote_weight = number >set_cpy_start %set_remote_weight;
   rresolv = ( tok_ipv4 @set_remote_resolv4 | tok_ipv6 @set_remote_resolv6 );
 
-  source_addr = host_or_addr >set_cpy_start %set_source_addr;
+  source_spec = host_or_addr ( '/' number )?;
+  source_addr = ( source_spec ( ',' ws* source_spec )* ) >set_cpy_start %set_source_addr;
+
+  balance_type = ( tok_round_robin @set_balance_round_robin | tok_weighted @set_balance_weighted | tok_least_conn @set_balance_least_conn | tok_hash_source @set_balance_hash_source );
+  relay_type = ( tok_copy @set_relay_copy | tok_splice @set_relay_splice );
+  backlog_value = number >set_cpy_start %set_backlog;
+  connect_timeout_value = number >set_cpy_start %set_connect_timeout;
+  idle_timeout_value = number >set_cpy_start %set_idle_timeout;
+  linger_timeout_value = number >set_cpy_start %set_linger_timeout;
+  connect_retries_value = number >set_cpy_start %set_connect_retries;
+  preconnect_value = number >set_cpy_start %set_preconnect;
+  max_fails_value = number >set_cpy_start %set_max_fails;
+  fail_timeout_value = number >set_cpy_start %set_fail_timeout;
+  health_check_value = number >set_cpy_start %set_health_check;
+  slow_start_value = number >set_cpy_start %set_slow_start;
+  hex_number = "0x"i [0-9a-fA-F]+;
+  defer_connect_value = ( tok_on @set_defer_connect_on | tok_off @set_defer_connect_off );
+  fastopen_value = number >set_cpy_start %set_fastopen;
+  defer_accept_value = number >set_cpy_start %set_defer_accept;
+  nodelay_value = ( tok_on @set_nodelay_on | tok_off @set_nodelay_off );
+  rcvbuf_value = number >set_cpy_start %set_rcvbuf;
+  sndbuf_value = number >set_cpy_start %set_sndbuf;
+  notsent_lowat_value = number >set_cpy_start %set_notsent_lowat;
+  keepidle_value = number >set_cpy_start %set_keepidle;
+  keepintvl_value = number >set_cpy_start %set_keepintvl;
+  keepcnt_value = number >set_cpy_start %set_keepcnt;
+  user_timeout_value = number >set_cpy_start %set_user_timeout;
+  priority_value = number >set_cpy_start %set_priority;
+  tos_value = ( number | hex_number ) >set_cpy_start %set_tos;
+  congestion_value = name >set_cpy_start %set_congestion;
 
   resolv = "resolv" ws* ":" ws+ lresolv ws* ";";
-  remote = "remote" ws* ":" ws+ remote_addr ws+ remote_port ws* ";";
+  remote = "remote" ws* ":" ws+ remote_addr ws+ remote_port ( ws+ "weight" ws+ remote_weight )? ws* ";" @add_remote;
   remote_resolv = "remote-resolv" ws* ":" ws+ rresolv ws* ";";
   source = "source" ws* ":" ws+ source_addr ws* ";";
+  balance = "balance" ws* ":" ws+ balance_type ws* ";";
+  relay = "relay" ws* ":" ws+ relay_type ws* ";";
+  backlog = "backlog" ws* ":" ws+ backlog_value ws* ";";
+  connect_timeout = "connect-timeout" ws* ":" ws+ connect_timeout_value ws* ";";
+  idle_timeout = "idle-timeout" ws* ":" ws+ idle_timeout_value ws* ";";
+  linger_timeout = "linger-timeout" ws* ":" ws+ linger_timeout_value ws* ";";
+  connect_retries = "connect-retries" ws* ":" ws+ connect_retries_value ws* ";";
+  preconnect = "preconnect" ws* ":" ws+ preconnect_value ws* ";";
+  defer_connect = "defer-connect" ws* ":" ws+ defer_connect_value ws* ";";
+  max_fails = "max-fails" ws* ":" ws+ max_fails_value ws* ";";
+  fail_timeout = "fail-timeout" ws* ":" ws+ fail_timeout_value ws* ";";
+  health_check = "health-check" ws* ":" ws+ health_check_value ws* ";";
+  slow_start = "slow-start" ws* ":" ws+ slow_start_value ws* ";";
+
+  nodelay = "nodelay" ws* ":" ws+ nodelay_value ws* ";";
+  rcvbuf = "rcvbuf" ws* ":" ws+ rcvbuf_value ws* ";";
+  sndbuf = "sndbuf" ws* ":" ws+ sndbuf_value ws* ";";
+  notsent_lowat = "notsent-lowat" ws* ":" ws+ notsent_lowat_value ws* ";";
+  keepalive = "keepalive" ws* ":" ws+ keepidle_value ws+ keepintvl_value ws+ keepcnt_value ws* ";";
+  user_timeout = "user-timeout" ws* ":" ws+ user_timeout_value ws* ";";
+  priority = "priority" ws* ":" ws+ priority_value ws* ";";
+  tos = "tos" ws* ":" ws+ tos_value ws* ";";
+  fastopen = "fastopen" ws* ":" ws+ fastopen_value ws* ";";
+  defer_accept = "defer-accept" ws* ":" ws+ defer_accept_value ws* ";";
+  congestion = "congestion" ws* ":" ws+ congestion_value ws* ";";
+  sockopts_side = ( "client" @set_sockopts_client | "upstream" @set_sockopts_upstream );
+  sockopts_body = '{' ( ign+ | nodelay | rcvbuf | sndbuf | notsent_lowat | keepalive | user_timeout | priority | tos | congestion | fastopen | defer_accept )* '};';
+  socket_body = '{' ( ign+ | backlog | sockopts_side ign* sockopts_body )* '};';
+  socket = "socket" ign* socket_body;
 
   listen_head = 'listen' ws+ local_addr ws+ local_port;
-  listen_body = '{' ( ign+ | resolv | remote | remote_resolv | source )* '};' @add_listener;
+  listen_body = '{' ( ign+ | resolv | remote | remote_resolv | source | balance | relay | backlog | connect_timeout | idle_timeout | linger_timeout | connect_retries | preconnect | defer_connect | max_fails | fail_timeout | health_check | slow_start | socket )* '};' @add_listener;
 
   main := ( listen_head ign* listen_body | ign+ )* $!logerror;
 }%%
@@ -172,6 +372,7 @@ int parse_listener(char* p, char* pe, listeners_t* listener)
   char* cpy_start = NULL;
   struct listener lst;
   init_listener_struct(&lst);
+  tcp_sockopts_t* so = &(lst.client_opts_);
 
   char* eof = pe;
   %% write exec;
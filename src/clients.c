@@ -25,6 +25,7 @@
  *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include "datatypes.h"
 
 #include <errno.h>
@@ -34,13 +35,16 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <fcntl.h>
 
 #include "clients.h"
 #include "tcp.h"
+#include "poller.h"
+#include "pool.h"
 #include "log.h"
 
 void clients_delete_element(void* e)
@@ -50,159 +54,852 @@ void clients_delete_element(void* e)
 
   client_t* element = (client_t*)e;
   close(element->fd_[0]);
-  close(element->fd_[1]);
-  if(element->write_buf_[0].buf_)
-    free(element->write_buf_[0].buf_);
-  if(element->write_buf_[1].buf_)
-    free(element->write_buf_[1].buf_);
+  if(element->fd_[1] >= 0)
+    close(element->fd_[1]);
+  int i;
+  for(i = 0; i < CLIENT_CONNECT_ATTEMPTS; ++i) {
+    if(element->connect_.fd_[i] >= 0)
+      close(element->connect_.fd_[i]);
+    backends_source_release(element->backends_, element->connect_.source_[i]);
+    backends_release(element->backends_, element->connect_.backend_[i]);
+  }
+  backends_source_release(element->backends_, element->source_);
+  for(i = 0; i < 2; ++i) {
+    /* buffers of the io_uring data path belong to the registered area */
+    if(element->write_buf_[i].buf_ && element->ring_slot_ < 0)
+      pool_free(element->write_buf_[i].buf_);
+    if(element->pipe_[i].fd_[0] >= 0) {
+      close(element->pipe_[i].fd_[0]);
+      close(element->pipe_[i].fd_[1]);
+    }
+  }
+  backends_release(element->backends_, element->backend_);
+  backends_unref(element->backends_);
+  client_bytes_unref(element->bytes_);
+
+  pool_free(e);
+}
+
+client_bytes_t* client_bytes_new()
+{
+  client_bytes_t* b = malloc(sizeof(client_bytes_t));
+  if(!b)
+    return NULL;
+
+  b->transferred_[0] = 0;
+  b->transferred_[1] = 0;
+  b->refcnt_ = 1;
+  return b;
+}
+
+client_bytes_t* client_bytes_ref(client_bytes_t* b)
+{
+  if(b)
+    b->refcnt_++;
+  return b;
+}
+
+void client_bytes_unref(client_bytes_t* b)
+{
+  if(b && --(b->refcnt_) <= 0)
+    free(b);
+}
+
+/* with io_uring the transmit buffers of connected clients come from one
+   area registered with the kernel up front, if the kernel refuses the
+   whole size, e.g. because of RLIMIT_MEMLOCK, a smaller one is tried */
+static int clients_ring_init(clients_t* list)
+{
+  clients_ring_t* r = &(list->ring_);
+  memset(r, 0, sizeof(clients_ring_t));
+  if(list->poller_->backend_ != POLLER_IO_URING)
+    return 0;
+
+  r->slot_size_ = 2 * list->buffer_size_;
+  int num;
+  for(num = CLIENTS_RING_MEMORY / r->slot_size_; num >= CLIENTS_RING_MIN_SLOTS; num /= 2) {
+    r->size_ = (size_t)num * r->slot_size_;
+    r->base_ = mmap(NULL, r->size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(r->base_ == MAP_FAILED) {
+      r->base_ = NULL;
+      continue;
+    }
+    if(!poller_io_register(list->poller_, r->base_, r->size_))
+      break;
+    log_printf(DEBUG, "unable to register %zu bytes of buffers with io_uring: %s", r->size_, strerror(errno));
+    munmap(r->base_, r->size_);
+    r->base_ = NULL;
+  }
+  if(!r->base_) {
+    log_printf(WARNING, "unable to register buffers with io_uring, relaying data using readiness events");
+    return 0;
+  }
 
-  free(e);
+  r->free_ = malloc(num * sizeof(int));
+  r->owners_ = calloc(num, sizeof(client_t*));
+  r->pending_ = calloc(num, sizeof(u_int8_t));
+  if(!r->free_ || !r->owners_ || !r->pending_)
+    return -2;
+  r->num_slots_ = num;
+  for(r->num_free_ = 0; r->num_free_ < num; r->num_free_++)
+    r->free_[r->num_free_] = num - 1 - r->num_free_;
+
+  log_printf(INFO, "registered buffers for %d clients (%zu bytes) with io_uring", num, r->size_);
+  return 0;
 }
 
-int clients_init(clients_t* list, int32_t buffer_size)
+static void clients_ring_clear(clients_t* list)
 {
+  clients_ring_t* r = &(list->ring_);
+  /* the pages stay pinned by the kernel until the ring is closed, operations
+     still in flight can't write anywhere else */
+  if(r->base_)
+    munmap(r->base_, r->size_);
+  if(r->free_)
+    free(r->free_);
+  if(r->owners_)
+    free(r->owners_);
+  if(r->pending_)
+    free(r->pending_);
+  memset(r, 0, sizeof(clients_ring_t));
+}
+
+int clients_init(clients_t* list, int32_t buffer_size, poller_t* poller)
+{
+  list->first_ = NULL;
+  list->length_ = 0;
+  memset(list->states_, 0, sizeof(list->states_));
+  list->ready_ = NULL;
+  timer_wheel_init(&(list->timers_));
+  list->fds_ = NULL;
+  list->fds_len_ = 0;
   list->buffer_size_ = buffer_size;
-  return slist_init(&(list->list_), &clients_delete_element);
+  list->poller_ = poller;
+  list->pipe_pool_ = NULL;
+  list->pipe_pool_len_ = 0;
+  list->setups_ = 0;
+  list->setup_syscalls_ = 0;
+  list->scratch_.length_ = buffer_size;
+  list->scratch_.buf_ = malloc(buffer_size);
+  if(!list->scratch_.buf_)
+    return -2;
+  return clients_ring_init(list);
 }
 
 void clients_clear(clients_t* list)
 {
-  slist_clear(&(list->list_));
+  while(list->first_) {
+    client_t* c = list->first_;
+    list->first_ = c->next_;
+    clients_delete_element(c);
+  }
+  list->length_ = 0;
+  memset(list->states_, 0, sizeof(list->states_));
+  if(list->fds_)
+    free(list->fds_);
+  list->fds_ = NULL;
+  list->fds_len_ = 0;
+
+  int i;
+  for(i = 0; i < list->pipe_pool_len_; ++i) {
+    close(list->pipe_pool_[i].fd_[0]);
+    close(list->pipe_pool_[i].fd_[1]);
+  }
+  if(list->pipe_pool_)
+    free(list->pipe_pool_);
+  list->pipe_pool_ = NULL;
+  list->pipe_pool_len_ = 0;
+
+  if(list->scratch_.buf_)
+    free(list->scratch_.buf_);
+  list->scratch_.buf_ = NULL;
+  clients_ring_clear(list);
 }
 
-static int handle_connect(client_t* c, int32_t buffer_size_)
+#ifdef HAVE_SPLICE
+static int pipe_get(clients_t* list, relay_pipe_t* p)
 {
-  if(!c || c->state_ != CONNECTING)
-    return -1;
+  if(list->pipe_pool_len_) {
+    *p = list->pipe_pool_[--list->pipe_pool_len_];
+    return 0;
+  }
 
-  int error = 0;
-  socklen_t len = sizeof(error);
-  if(getsockopt(c->fd_[1], SOL_SOCKET, SO_ERROR, &error, &len)==-1) {
-    log_printf(ERROR, "Error on getsockopt(): %s", strerror(errno));
+  if(pipe2(p->fd_, O_NONBLOCK | O_CLOEXEC)) {
+    log_printf(ERROR, "Error on pipe2(): %s", strerror(errno));
+    p->fd_[0] = p->fd_[1] = -1;
+    return -1;
+  }
+  int size = fcntl(p->fd_[1], F_SETPIPE_SZ, list->buffer_size_);
+  if(size < 0)
+    size = fcntl(p->fd_[1], F_GETPIPE_SZ);
+  if(size <= 0) {
+    log_printf(ERROR, "Error on fcntl(F_GETPIPE_SZ): %s", strerror(errno));
+    close(p->fd_[0]);
+    close(p->fd_[1]);
+    p->fd_[0] = p->fd_[1] = -1;
     return -1;
   }
-  if(error) {
-    log_printf(ERROR, "Error on connect(): %s, not adding client %d", strerror(error), c->fd_[0]);
+  p->size_ = size;
+  return 0;
+}
+#endif
+
+static void pipe_put(clients_t* list, relay_pipe_t* p, u_int32_t pending)
+{
+  if(p->fd_[0] < 0)
+    return;
+
+  if(!pending && list->pipe_pool_len_ < PIPE_POOL_SIZE) {
+    if(!list->pipe_pool_) {
+      list->pipe_pool_ = malloc(PIPE_POOL_SIZE * sizeof(relay_pipe_t));
+    }
+    if(list->pipe_pool_) {
+      list->pipe_pool_[list->pipe_pool_len_++] = *p;
+      p->fd_[0] = p->fd_[1] = -1;
+      return;
+    }
+  }
+
+  close(p->fd_[0]);
+  close(p->fd_[1]);
+  p->fd_[0] = p->fd_[1] = -1;
+}
+
+static int client_fd_interest(client_t* c, int i)
+{
+  int events = 0;
+  if(c->state_ == CONNECTED || c->state_ == CLOSING) {
+    if(c->write_buf_offset_[i^1] < c->write_buf_[i^1].length_) {
+      switch(c->fd_state_[i]) {
+      case ESTABLISHED:
+      case FIN_PENDING:
+      case FIN_LINGER: events |= POLLER_READ; break;
+      default: /* not reading */;
+      }
+    }
+    if(c->write_buf_offset_[i]) {
+      switch(c->fd_state_[i]) {
+      case ESTABLISHED:
+      case RCV_STOPPED:
+      case FIN_PENDING:
+      case CLOSE_PENDING: events |= POLLER_WRITE; break;
+      default: /* not writing */;
+      }
+    }
+  } else if(c->state_ == CONNECTING && i == 1)
+    events |= POLLER_WRITE;
+  else if(c->state_ == WAITING && i == 0)
+    events |= POLLER_READ;
+
+  return events;
+}
+
+/* operations of the io_uring data path are identified by the buffer slot
+   of the client, the buffer they work on and whether they send or receive */
+#define CLIENT_RING_OP(i, send) (((i) << 1) | (send))
+#define CLIENT_RING_DATA(slot, op) (((u_int64_t)(slot) << 2) | (op))
+
+static int client_ring_queue(clients_t* list, client_t* c, int i, int send, u_int8_t* addr, u_int32_t len)
+{
+  int op = CLIENT_RING_OP(i, send);
+  int fd = send ? c->fd_[i] : c->fd_[i^1];
+  if(poller_io_submit(list->poller_, send, fd, addr, len, CLIENT_RING_DATA(c->ring_slot_, op), c->ring_wait_ & (1 << op))) {
+    log_printf(ERROR, "unable to queue %s on %d, removing client %d", send ? "send" : "recv", fd, c->fd_[0]);
     return -1;
   }
+  c->ring_ops_ |= 1 << op;
+  c->ring_wait_ &= ~(1 << op);
+  list->ring_.pending_[c->ring_slot_]++;
+  return 0;
+}
 
+/* keeps a receive going on every socket while there is room in the buffer
+   towards the other side and a send on every socket with data queued, this
+   is what client_fd_interest() does for the readiness based relaying */
+static int client_ring_submit(clients_t* list, client_t* c)
+{
   int i;
   for(i = 0; i < 2; ++i) {
-    c->write_buf_[i].buf_ = malloc(buffer_size_);
-    if(!c->write_buf_[i].buf_) return -2;
-    c->write_buf_[i].length_ = buffer_size_;
-    c->write_buf_offset_[i] = 0;
-    c->transferred_[i] = 0;
+    buffer_t* buf = &(c->write_buf_[i]);
+    client_fd_state_t in = c->fd_state_[i^1];
+    if(!(c->ring_ops_ & (1 << CLIENT_RING_OP(i, 0))) && c->write_buf_offset_[i] < buf->length_ &&
+       (in == ESTABLISHED || in == FIN_PENDING || in == FIN_LINGER)) {
+      if(!c->write_buf_offset_[i])
+        c->write_buf_start_[i] = 0;
+      u_int32_t tail = c->write_buf_start_[i] + c->write_buf_offset_[i];
+      u_int32_t pos = tail >= buf->length_ ? tail - buf->length_ : tail;
+      u_int32_t len = tail >= buf->length_ ? buf->length_ - c->write_buf_offset_[i] : buf->length_ - tail;
+      /* a receive completes as soon as anything arrives, a small piece at the
+         end of the buffer is left alone until the send going on frees the start */
+      if((len >= buf->length_ / 2 || len == buf->length_ - c->write_buf_offset_[i]) &&
+         client_ring_queue(list, c, i, 0, &(buf->buf_[pos]), len))
+        return -1;
+    }
+
+    client_fd_state_t out = c->fd_state_[i];
+    if(!(c->ring_ops_ & (1 << CLIENT_RING_OP(i, 1))) && c->write_buf_offset_[i] &&
+       (out == ESTABLISHED || out == RCV_STOPPED || out == FIN_PENDING || out == CLOSE_PENDING)) {
+      u_int32_t len = buf->length_ - c->write_buf_start_[i];
+      if(len > c->write_buf_offset_[i])
+        len = c->write_buf_offset_[i];
+      if(client_ring_queue(list, c, i, 1, &(buf->buf_[c->write_buf_start_[i]]), len))
+        return -1;
+    }
+  }
+  return 0;
+}
+
+static void client_ring_attach(clients_t* list, client_t* c)
+{
+  clients_ring_t* r = &(list->ring_);
+  if(c->relay_ != RELAY_COPY || !r->num_free_)
+    return;
+
+  int slot = r->free_[--r->num_free_];
+  r->owners_[slot] = c;
+  c->ring_slot_ = slot;
+  c->ring_ops_ = 0;
+  c->ring_wait_ = 0;
+  int i;
+  for(i = 0; i < 2; ++i) {
+    c->write_buf_[i].buf_ = &(r->base_[(size_t)slot * r->slot_size_ + i * list->buffer_size_]);
+    poller_set(list->poller_, c->fd_[i], 0);
   }
+}
 
-  log_printf(INFO, "successfully added client %d", c->fd_[0]);
-  c->state_ = CONNECTED;
-  c->fd_state_[1] = ESTABLISHED;
+/* operations still in flight are cancelled, the slot is only reused once
+   all of them have completed */
+static void client_ring_detach(clients_t* list, client_t* c)
+{
+  clients_ring_t* r = &(list->ring_);
+  int op;
+  for(op = 0; op < 4; ++op)
+    if(c->ring_ops_ & (1 << op))
+      poller_io_cancel(list->poller_, CLIENT_RING_DATA(c->ring_slot_, op));
+
+  r->owners_[c->ring_slot_] = NULL;
+  if(!r->pending_[c->ring_slot_])
+    r->free_[r->num_free_++] = c->ring_slot_;
+  c->ring_slot_ = -1;
+  c->write_buf_[0].buf_ = NULL;
+  c->write_buf_[1].buf_ = NULL;
+}
+
+static int client_update_interest(clients_t* list, client_t* c)
+{
+  if(c->ring_slot_ >= 0)
+    return client_ring_submit(list, c);
+
+  int i;
+  for(i=0; i<2; ++i) {
+    if(c->fd_[i] < 0)
+      continue;
+    int events = client_fd_interest(c, i);
+    if(poller_set(list->poller_, c->fd_[i], events)) {
+      log_printf(ERROR, "unable to update event interest for %d, removing client %d", c->fd_[i], c->fd_[0]);
+      return -1;
+    }
+    log_printf(DEBUG, "interest for %d is now%s%s", c->fd_[i], (events & POLLER_READ) ? " READ" : "", (events & POLLER_WRITE) ? " WRITE" : "");
+  }
   return 0;
 }
 
-int clients_add(clients_t* list, int fd, const tcp_endpoint_t remote_end, const tcp_endpoint_t source_end)
+static int client_map_fd(clients_t* list, int fd, client_t* c)
 {
-  if(!list)
-    return -1;
+  if(fd >= list->fds_len_) {
+    int len = list->fds_len_ ? list->fds_len_ : 1024;
+    while(len <= fd)
+      len *= 2;
+    client_t** fds = realloc(list->fds_, len * sizeof(client_t*));
+    if(!fds)
+      return -2;
+    memset(&(fds[list->fds_len_]), 0, (len - list->fds_len_) * sizeof(client_t*));
+    list->fds_ = fds;
+    list->fds_len_ = len;
+  }
+  list->fds_[fd] = c;
+  return 0;
+}
 
-  client_t* element = malloc(sizeof(client_t));
-  if(!element) {
-    close(fd);
+static int client_link(clients_t* list, client_t* c)
+{
+  if(client_map_fd(list, c->fd_[0], c))
     return -2;
+
+  c->ready_ = 0;
+  c->ready_next_ = NULL;
+  c->prev_ = NULL;
+  c->next_ = list->first_;
+  if(list->first_)
+    list->first_->prev_ = c;
+  list->first_ = c;
+  list->length_++;
+  list->states_[c->state_]++;
+  return 0;
+}
+
+/* the number of clients per state is kept up to date for the metrics */
+static void client_set_state(clients_t* list, client_t* c, client_state_t state)
+{
+  list->states_[c->state_]--;
+  list->states_[state]++;
+  c->state_ = state;
+}
+
+static u_int64_t client_deadline(client_t* c)
+{
+  u_int32_t timeout = 0;
+  switch(c->state_) {
+  case WAITING: timeout = c->timeouts_.idle_; break;
+  case CONNECTING: {
+    u_int64_t deadline = c->timeouts_.connect_ ? c->since_ + c->timeouts_.connect_ : 0;
+    if(c->connect_.next_at_ && (!deadline || c->connect_.next_at_ < deadline))
+      return c->connect_.next_at_;
+    return deadline;
+  }
+  case CONNECTED: timeout = c->timeouts_.idle_; break;
+  case CLOSING: timeout = c->timeouts_.linger_ ? c->timeouts_.linger_ : c->timeouts_.idle_; break;
   }
+  return timeout ? c->last_active_ + timeout : 0;
+}
 
+static void client_update_timer(clients_t* list, client_t* c)
+{
+  u_int64_t deadline = client_deadline(c);
+  if(deadline)
+    timer_wheel_set(&(list->timers_), &(c->timer_), deadline);
+  else
+    timer_wheel_cancel(&(list->timers_), &(c->timer_));
+}
+
+static void client_remove(clients_t* list, client_t* c)
+{
+  if(c->ring_slot_ >= 0)
+    client_ring_detach(list, c);
+  timer_wheel_cancel(&(list->timers_), &(c->timer_));
+  poller_set(list->poller_, c->fd_[0], 0);
+  list->fds_[c->fd_[0]] = NULL;
+  if(c->fd_[1] >= 0) {
+    poller_set(list->poller_, c->fd_[1], 0);
+    list->fds_[c->fd_[1]] = NULL;
+  }
   int i;
-  for(i = 0; i < 2; ++i) {
-    element->write_buf_[i].buf_ = NULL;
-    element->write_buf_[i].length_ = 0;
-    element->write_buf_offset_[i] = 0;
+  for(i = 0; i < CLIENT_CONNECT_ATTEMPTS; ++i) {
+    if(c->connect_.fd_[i] >= 0) {
+      poller_set(list->poller_, c->connect_.fd_[i], 0);
+      list->fds_[c->connect_.fd_[i]] = NULL;
+    }
   }
-  element->state_ = CONNECTING;
-  element->fd_[0] = fd;
-  element->fd_state_[0] = ESTABLISHED;
-  element->fd_[1] = socket(remote_end.addr_.ss_family, SOCK_STREAM, 0);
-  if(element->fd_[1] < 0) {
-    log_printf(INFO, "Error on socket(): %s, not adding client %d", strerror(errno), element->fd_[0]);
-    close(element->fd_[0]);
-    free(element);
-    return -1;
+  pipe_put(list, &(c->pipe_[0]), c->write_buf_offset_[0]);
+  pipe_put(list, &(c->pipe_[1]), c->write_buf_offset_[1]);
+
+  if(c->prev_)
+    c->prev_->next_ = c->next_;
+  else
+    list->first_ = c->next_;
+  if(c->next_)
+    c->next_->prev_ = c->prev_;
+  list->length_--;
+  list->states_[c->state_]--;
+
+  clients_delete_element(c);
+}
+
+static void client_connect_drop(clients_t* list, client_t* c, int slot)
+{
+  int fd = c->connect_.fd_[slot];
+  poller_set(list->poller_, fd, 0);
+  list->fds_[fd] = NULL;
+  close(fd);
+  c->connect_.fd_[slot] = -1;
+  backends_source_release(c->backends_, c->connect_.source_[slot]);
+  c->connect_.source_[slot] = -1;
+  backends_release(c->backends_, c->connect_.backend_[slot]);
+  c->connect_.backend_[slot] = -1;
+  c->connect_.pending_--;
+}
+
+static int client_connect_done(clients_t* list, client_t* c, int slot)
+{
+  client_connect_t* cn = &(c->connect_);
+  c->fd_[1] = cn->fd_[slot];
+  cn->fd_[slot] = -1;
+  c->source_ = cn->source_[slot];
+  cn->source_[slot] = -1;
+  cn->pending_--;
+  backends_report(c->backends_, cn->backend_[slot], 1);
+  /* the client takes over the reference of the attempt */
+  backends_release(c->backends_, c->backend_);
+  c->backend_ = cn->backend_[slot];
+  cn->backend_[slot] = -1;
+  int i;
+  for(i = 0; i < CLIENT_CONNECT_ATTEMPTS; ++i) {
+    if(cn->fd_[i] >= 0)
+      client_connect_drop(list, c, i);
   }
-  element->fd_state_[1] = ESTABLISHING;
+  cn->next_at_ = 0;
 
-  int on = 1;
-  if(setsockopt(element->fd_[0], IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) ||
-     setsockopt(element->fd_[1], IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on))) {
-    log_printf(ERROR, "Error on setsockopt(): %s", strerror(errno));
-    close(element->fd_[0]);
-    close(element->fd_[1]);
-    free(element);
-    return -1;
+  for(i = 0; i < 2; ++i) {
+#ifdef HAVE_SPLICE
+    if(c->relay_ == RELAY_SPLICE) {
+      if(pipe_get(list, &(c->pipe_[i])))
+        return -1;
+      c->write_buf_[i].length_ = c->pipe_[i].size_;
+    } else
+#endif
+      /* the buffer is only attached while data is queued, see client_pass() */
+      c->write_buf_[i].length_ = list->buffer_size_;
+    c->write_buf_start_[i] = 0;
+    c->write_buf_offset_[i] = 0;
+    c->transferred_[i] = 0;
   }
+  client_ring_attach(list, c);
 
-  if(fcntl(element->fd_[0], F_SETFL, O_NONBLOCK) ||
-     fcntl(element->fd_[1], F_SETFL, O_NONBLOCK)) {
-    log_printf(ERROR, "Error on fcntl(): %s", strerror(errno));
-    close(element->fd_[0]);
-    close(element->fd_[1]);
-    free(element);
+  list->setups_++;
+  list->setup_syscalls_ += c->syscalls_;
+  log_printf(INFO, "successfully added client %d (%u system calls)", c->fd_[0], c->syscalls_);
+  client_set_state(list, c, CONNECTED);
+  c->fd_state_[1] = ESTABLISHED;
+  c->last_active_ = timer_wheel_now(&(list->timers_));
+  client_update_timer(list, c);
+  return client_update_interest(list, c);
+}
+
+static int client_connect_socket(clients_t* list, client_t* c, const tcp_endpoint_t* remote_end, int* source)
+{
+  int fd = socket(remote_end->addr_.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  c->syscalls_++;
+  if(fd < 0) {
+    c->connect_.error_ = errno;
+    log_printf(INFO, "Error on socket(): %s, client %d", strerror(errno), c->fd_[0]);
     return -1;
   }
 
-  if(source_end.addr_.ss_family != AF_UNSPEC) {
-    if(bind(element->fd_[1], (struct sockaddr *)&(source_end.addr_), source_end.len_)==-1) {
-      log_printf(INFO, "Error on bind(): %s, not adding client %d", strerror(errno), element->fd_[0]);
-      close(element->fd_[0]);
-      close(element->fd_[1]);
-      free(element);
+  /* splice() can't put data into the SYN, so fast open is only used when copying */
+  int which = TCP_SOCKOPTS_BUFFERS | TCP_SOCKOPTS_CONNECTION;
+  if(c->relay_ == RELAY_COPY)
+    which |= TCP_SOCKOPTS_FASTOPEN;
+  c->syscalls_ += tcp_set_sockopts(fd, remote_end->addr_.ss_family, &(c->backends_->sockopts_), which);
+
+  *source = backends_source_acquire(c->backends_, c->connect_.source_full_);
+  if(*source >= 0) {
+    int ret = tcp_bind_source(fd, &(c->backends_->sources_[*source].addr_));
+    if(ret < 0) {
+      c->connect_.error_ = errno;
+      log_printf(INFO, "Error on bind(): %s, client %d", strerror(errno), c->fd_[0]);
+      backends_source_release(c->backends_, *source);
+      *source = -1;
+      close(fd);
       return -1;
     }
+    c->syscalls_ += ret;
   }
 
-  if(slist_add(&(list->list_), element) == NULL) {
-    close(element->fd_[0]);
-    close(element->fd_[1]);
-    free(element);
-    return -2;
+  return fd;
+}
+
+/* moves on to another backend once all addresses of the current one have
+   failed, if only the same remote is left it is tried again after
+   CLIENT_CONNECT_RETRY_DELAY to get over restarts of the backend */
+static int client_connect_retry(clients_t* list, client_t* c)
+{
+  client_connect_t* cn = &(c->connect_);
+  if(cn->retries_ >= c->backends_->retries_ || cn->error_ == EMFILE || cn->error_ == ENFILE)
+    return -1;
+
+  int group = c->backends_->list_[c->backend_].group_;
+  int backend = backends_select(c->backends_, c->backends_->source_end_.addr_.ss_family, group, cn->hash_);
+  if(backend < 0)
+    return -1;
+
+  cn->retries_++;
+  backends_release(c->backends_, c->backend_);
+  c->backend_ = backend;
+  cn->next_ = 0;
+  if(c->backends_->list_[backend].group_ == group)
+    cn->next_at_ = timer_wheel_now(&(list->timers_)) + CLIENT_CONNECT_RETRY_DELAY;
+
+  if(log_enabled(INFO)) {
+    char* rs = tcp_endpoint_to_string(c->backends_->list_[backend].addr_);
+    log_printf(INFO, "retrying client %d with backend %s (%d/%d)", c->fd_[0], rs ? rs:"(null)", cn->retries_, c->backends_->retries_);
+    if(rs) free(rs);
   }
+  return 0;
+}
 
-  if(connect(element->fd_[1], (struct sockaddr *)&(remote_end.addr_), remote_end.len_)==-1) {
-    if(errno == EINPROGRESS)
+/* starts connection attempts to the remaining addresses of the backend until
+   one is in progress, another one is due after CLIENT_CONNECT_ATTEMPT_DELAY
+   unless the running attempts fail earlier */
+static int client_connect_start(clients_t* list, client_t* c)
+{
+  client_connect_t* cn = &(c->connect_);
+  int family = c->backends_->source_end_.addr_.ss_family;
+  cn->next_at_ = 0;
+  for(;;) {
+    int slot;
+    for(slot = 0; slot < CLIENT_CONNECT_ATTEMPTS && cn->fd_[slot] >= 0; ++slot);
+    if(slot >= CLIENT_CONNECT_ATTEMPTS)
       return 0;
 
-    log_printf(INFO, "Error on connect(): %s, not adding client %d", strerror(errno), element->fd_[0]);
-    slist_remove(&(list->list_), element);
+    int backend = backends_candidate(c->backends_, c->backend_, family, cn->next_);
+    if(backend < 0) {
+      if(cn->pending_ || client_connect_retry(list, c))
+        break;
+      if(cn->next_at_)
+        return 0;
+      continue;
+    }
+    cn->next_++;
+
+    const tcp_endpoint_t* remote_end = &(c->backends_->list_[backend].addr_);
+    int source = -1;
+    int fd = client_connect_socket(list, c, remote_end, &source);
+    if(fd < 0) {
+      if(cn->error_ == EMFILE || cn->error_ == ENFILE)
+        break;
+      continue;
+    }
+    if(client_map_fd(list, fd, c)) {
+      backends_source_release(c->backends_, source);
+      close(fd);
+      return -2;
+    }
+    /* every attempt holds a reference to its backend, this keeps the slot
+       from being reused for another address by a DNS update meanwhile */
+    cn->fd_[slot] = fd;
+    cn->backend_[slot] = backend;
+    backends_acquire(c->backends_, backend);
+    cn->source_[slot] = source;
+    cn->pending_++;
+
+    c->syscalls_++;
+    if(connect(fd, (struct sockaddr *)&(remote_end->addr_), remote_end->len_)==-1) {
+      if(errno == EINPROGRESS) {
+        if(poller_set(list->poller_, fd, POLLER_WRITE)) {
+          log_printf(ERROR, "unable to update event interest for %d, removing client %d", fd, c->fd_[0]);
+          return -1;
+        }
+        if(backends_candidate(c->backends_, c->backend_, family, cn->next_) >= 0)
+          cn->next_at_ = timer_wheel_now(&(list->timers_)) + CLIENT_CONNECT_ATTEMPT_DELAY;
+        return 0;
+      }
+
+      cn->error_ = errno;
+      /* the source address ran out of ports towards this backend, that's
+         no fault of the backend so the same address is tried with another source */
+      if(cn->error_ == EADDRNOTAVAIL && cn->source_retries_ < c->backends_->num_sources_ - 1) {
+        log_printf(DEBUG, "client %d: no free port left on source address, trying another one", c->fd_[0]);
+        cn->source_retries_++;
+        cn->source_full_ = cn->source_[slot];
+        cn->next_--;
+        client_connect_drop(list, c, slot);
+        continue;
+      }
+      if(cn->error_ != EADDRNOTAVAIL)
+        backends_report(c->backends_, backend, 0);
+      if(log_enabled(INFO)) {
+        char* rs = tcp_endpoint_to_string(*remote_end);
+        log_printf(INFO, "Error on connect(%s): %s, client %d", rs ? rs:"(null)", strerror(cn->error_), c->fd_[0]);
+        if(rs) free(rs);
+      }
+      client_connect_drop(list, c, slot);
+      continue;
+    }
+
+    log_printf(DEBUG, "connect() for client %d returned immediatly", c->fd_[0]);
+    return client_connect_done(list, c, slot);
+  }
+
+  if(cn->pending_)
+    return 0;
+
+  log_printf(INFO, "Error on connect(): %s, not adding client %d", strerror(cn->error_), c->fd_[0]);
+  return (cn->error_ == EMFILE || cn->error_ == ENFILE) ? -3 : -1;
+}
+
+static int client_connect_check(clients_t* list, client_t* c, int slot)
+{
+  int error = 0;
+  socklen_t len = sizeof(error);
+  c->syscalls_++;
+  if(getsockopt(c->connect_.fd_[slot], SOL_SOCKET, SO_ERROR, &error, &len)==-1) {
+    log_printf(ERROR, "Error on getsockopt(): %s", strerror(errno));
     return -1;
   }
+  if(!error)
+    return client_connect_done(list, c, slot);
+
+  c->connect_.error_ = error;
+  backends_report(c->backends_, c->connect_.backend_[slot], 0);
+  if(log_enabled(INFO)) {
+    char* rs = tcp_endpoint_to_string(c->backends_->list_[c->connect_.backend_[slot]].addr_);
+    log_printf(INFO, "Error on connect(%s): %s, client %d", rs ? rs:"(null)", strerror(error), c->fd_[0]);
+    if(rs) free(rs);
+  }
+  client_connect_drop(list, c, slot);
+
+  int ret = client_connect_start(list, c);
+  if(!ret && c->state_ == CONNECTING)
+    client_update_timer(list, c);
+  return ret;
+}
+
+static int client_connect_begin(clients_t* list, client_t* c)
+{
+  client_set_state(list, c, CONNECTING);
+  c->since_ = timer_wheel_now(&(list->timers_));
+
+  int source = -1;
+  int spare = backends_take_spare(c->backends_, c->backend_, &source);
+  if(spare < 0)
+    return client_connect_start(list, c);
+  c->syscalls_++; /* checking the spare is still alive */
+
+  log_printf(DEBUG, "using preconnected socket %d for client %d", spare, c->fd_[0]);
+  if(client_map_fd(list, spare, c)) {
+    backends_source_release(c->backends_, source);
+    close(spare);
+    return -2;
+  }
+  c->connect_.fd_[0] = spare;
+  c->connect_.backend_[0] = c->backend_;
+  backends_acquire(c->backends_, c->backend_);
+  c->connect_.source_[0] = source;
+  c->connect_.pending_ = 1;
+  return client_connect_done(list, c, 0);
+}
 
-  log_printf(DEBUG, "connect() for client %d returned immediatly", element->fd_[0]);
+/* with deferred connects the upstream connection is only started once the
+   client has sent something, clients which close without sending anything
+   never cause a connection to the backend */
+static int client_wait(clients_t* list, client_t* c)
+{
+  char byte;
+  int len = recv(c->fd_[0], &byte, 1, MSG_PEEK);
+  c->syscalls_++;
+  if(len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return client_update_interest(list, c);
+  if(len < 0) {
+    log_printf(INFO, "Error on recv(): %s, removing client %d", strerror(errno), c->fd_[0]);
+    return -1;
+  }
+  if(!len) {
+    log_printf(INFO, "client %d closed the connection without sending anything, removing it", c->fd_[0]);
+    return -1;
+  }
 
-  int ret = handle_connect(element, list->buffer_size_);
+  log_printf(DEBUG, "client %d: received first data, connecting to backend", c->fd_[0]);
+  int ret = client_connect_begin(list, c);
   if(ret)
-    slist_remove(&(list->list_), element);
+    return ret;
+  if(c->state_ == CONNECTING) {
+    client_update_timer(list, c);
+    return client_update_interest(list, c);
+  }
+  return 0;
+}
 
-  return ret;
+int clients_add(clients_t* list, int fd, const tcp_endpoint_t* peer, backends_t* backends, client_bytes_t* bytes, relay_type_t relay, const client_timeouts_t timeouts, const tcp_sockopts_t* sockopts)
+{
+  if(!list)
+    return -1;
+
+  u_int32_t hash = backends_hash(peer);
+  int backend = backends_select(backends, backends ? backends->source_end_.addr_.ss_family : AF_UNSPEC, -1, hash);
+  if(backend < 0) {
+    log_printf(INFO, "no usable backend, not adding client %d", fd);
+    close(fd);
+    return -1;
+  }
+
+  client_t* element = pool_alloc(sizeof(client_t));
+  if(!element) {
+    backends_release(backends, backend);
+    close(fd);
+    return -2;
+  }
+
+  int i;
+  for(i = 0; i < 2; ++i) {
+    element->write_buf_[i].buf_ = NULL;
+    element->write_buf_[i].length_ = 0;
+    element->write_buf_start_[i] = 0;
+    element->write_buf_offset_[i] = 0;
+    element->pipe_[i].fd_[0] = element->pipe_[i].fd_[1] = -1;
+    element->pipe_[i].size_ = 0;
+  }
+  for(i = 0; i < CLIENT_CONNECT_ATTEMPTS; ++i) {
+    element->connect_.fd_[i] = -1;
+    element->connect_.backend_[i] = -1;
+    element->connect_.source_[i] = -1;
+  }
+  element->connect_.pending_ = 0;
+  element->connect_.next_ = 0;
+  element->connect_.next_at_ = 0;
+  element->connect_.retries_ = 0;
+  element->connect_.source_retries_ = 0;
+  element->connect_.source_full_ = -1;
+  element->connect_.hash_ = hash;
+  element->connect_.error_ = 0;
+  element->relay_ = relay;
+  element->backends_ = backends_ref(backends);
+  element->bytes_ = client_bytes_ref(bytes);
+  element->backend_ = backend;
+  element->source_ = -1;
+  element->ring_slot_ = -1;
+  element->ring_ops_ = 0;
+  element->ring_wait_ = 0;
+  element->timeouts_ = timeouts;
+  timer_entry_init(&(element->timer_), element);
+  element->since_ = timer_wheel_now(&(list->timers_));
+  element->last_active_ = element->since_;
+  element->syscalls_ = 1; /* accept4() */
+  element->state_ = CONNECTING;
+  element->fd_[0] = fd;
+  element->fd_state_[0] = ESTABLISHED;
+  element->fd_[1] = -1;
+  element->fd_state_[1] = ESTABLISHING;
+
+  /* the socket comes from accept4() non-blocking and with all options
+     inherited from the listening socket */
+  if(client_link(list, element)) {
+    clients_delete_element(element);
+    return -2;
+  }
+
+  int ret;
+  if(backends && backends->defer_connect_) {
+    client_set_state(list, element, WAITING);
+    /* with TCP_DEFER_ACCEPT the first data is most likely here already */
+    if(sockopts && sockopts->defer_accept_ > 0)
+      ret = client_wait(list, element);
+    else
+      ret = client_update_interest(list, element);
+  } else
+    ret = client_connect_begin(list, element);
+  if(ret) {
+    client_remove(list, element);
+    return ret;
+  }
+  if(element->state_ != CONNECTED)
+    client_update_timer(list, element);
+
+  return 0;
 }
 
 void clients_remove(clients_t* list, int fd)
 {
-  slist_remove(&(list->list_), clients_find(list, fd));
+  client_t* c = clients_find(list, fd);
+  if(c)
+    client_remove(list, c);
 }
 
 client_t* clients_find(clients_t* list, int fd)
 {
-  if(!list)
+  if(!list || fd < 0 || fd >= list->fds_len_)
     return NULL;
 
-  slist_element_t* tmp = list->list_.first_;
-  while(tmp) {
-    client_t* c = (client_t*)tmp->data_;
-    if(c && (c->fd_[0] == fd || c->fd_[1] == fd))
-      return c;
-    tmp = tmp->next_;
-  }
-
-  return NULL;
+  return list->fds_[fd];
 }
 
 void clients_print(clients_t* list)
@@ -210,20 +907,34 @@ void clients_print(clients_t* list)
   if(!list)
     return;
 
-  slist_element_t* tmp = list->list_.first_;
-  while(tmp) {
-    client_t* c = (client_t*)tmp->data_;
-    if(c) {
-      char state = '?';
-      switch(c->state_) {
-      case CONNECTING: state = '>'; break;
-      case CONNECTED: state = 'c'; break;
-      case CLOSING: state = '-'; break;
-      }
-      log_printf(NOTICE, "[%c] client #%d/%d: %lld bytes received, %lld bytes sent", state, c->fd_[0], c->fd_[1], c->transferred_[0], c->transferred_[1]);
+  if(list->setups_)
+    log_printf(NOTICE, "%d clients, %llu connections set up with %.1f system calls each on average", list->length_,
+               (unsigned long long)list->setups_, (double)list->setup_syscalls_ / list->setups_);
+  if(list->ring_.num_slots_)
+    log_printf(NOTICE, "io_uring buffers: %d of %d in use", list->ring_.num_slots_ - list->ring_.num_free_, list->ring_.num_slots_);
+
+  client_t* c;
+  for(c = list->first_; c; c = c->next_) {
+    char state = '?';
+    switch(c->state_) {
+    case WAITING: state = 'w'; break;
+    case CONNECTING: state = '>'; break;
+    case CONNECTED: state = 'c'; break;
+    case CLOSING: state = '-'; break;
     }
-    tmp = tmp->next_;
+    char* rs = tcp_endpoint_to_string(c->backends_->list_[c->backend_].addr_);
+    log_printf(NOTICE, "[%c] client #%d/%d (%s, remote: %s): %lld bytes received, %lld bytes sent", state, c->fd_[0], c->fd_[1], relay_type_to_string(c->relay_), rs ? rs:"(null)", c->transferred_[0], c->transferred_[1]);
+    if(rs) free(rs);
+  }
+}
+
+const char* relay_type_to_string(relay_type_t relay)
+{
+  switch(relay) {
+  case RELAY_COPY: return "copy";
+  case RELAY_SPLICE: return "splice";
   }
+  return "unknown";
 }
 
 static char* client_fd_state_to_string(client_fd_state_t s)
@@ -239,77 +950,13 @@ static char* client_fd_state_to_string(client_fd_state_t s)
   return ""; /* Hey GCC: shut up! */
 }
 
-void clients_read_fds(clients_t* list, fd_set* set, int* max_fd)
-{
-  if(!list)
-    return;
-
-  slist_element_t* tmp = list->list_.first_;
-  while(tmp) {
-    client_t* c = (client_t*)tmp->data_;
-    if(c && (c->state_ == CONNECTED || c->state_ == CLOSING)) {
-      int i;
-      for(i=0; i<2; ++i) {
-        if(c->write_buf_offset_[i^1] < c->write_buf_[i^1].length_) {
-          switch(c->fd_state_[i]) {
-          case ESTABLISHED:
-          case FIN_PENDING:
-          case FIN_LINGER: {
-            FD_SET(c->fd_[i], set);
-            *max_fd = *max_fd > c->fd_[i] ? *max_fd : c->fd_[i];
-            log_printf(DEBUG, "adding %d for READ", c->fd_[i]);
-          }
-          default: /* not adding fd */;
-          }
-        }
-      }
-    }
-    tmp = tmp->next_;
-  }
-}
-
-void clients_write_fds(clients_t* list, fd_set* set, int* max_fd)
-{
-  if(!list)
-    return;
-
-  slist_element_t* tmp = list->list_.first_;
-  while(tmp) {
-    client_t* c = (client_t*)tmp->data_;
-    if(c && (c->state_ == CONNECTED || c->state_ == CLOSING)) {
-      int i;
-      for(i=0; i<2; ++i) {
-        if(c->write_buf_offset_[i]) {
-          switch(c->fd_state_[i]) {
-          case ESTABLISHED:
-          case RCV_STOPPED:
-          case FIN_PENDING:
-          case CLOSE_PENDING: {
-            FD_SET(c->fd_[i], set);
-            *max_fd = *max_fd > c->fd_[i] ? *max_fd : c->fd_[i];
-            log_printf(DEBUG, "adding %d for WRITE", c->fd_[i]);
-          }
-          default: /* not adding fd */;
-          }
-        }
-      }
-    } else if(c && c->state_ == CONNECTING) {
-      FD_SET(c->fd_[1], set);
-      *max_fd = *max_fd > c->fd_[1] ? *max_fd : c->fd_[1];
-
-      log_printf(DEBUG, "adding %d for WRITE (connecting)", c->fd_[1]);
-    }
-    tmp = tmp->next_;
-  }
-}
-
-static int client_handle_recv_null(client_t* c, int in, int out)
+static int client_handle_recv_null(clients_t* list, client_t* c, int in, int out)
 {
   log_printf(DEBUG, "client %d: recv(%d) returned 0, %d: bytes=%d state=%s, %d: bytes=%d state=%s", c->fd_[0], c->fd_[in],
              c->fd_[0], c->write_buf_offset_[0], client_fd_state_to_string(c->fd_state_[0]),
              c->fd_[1], c->write_buf_offset_[1], client_fd_state_to_string(c->fd_state_[1]));
 
-  c->state_ = CLOSING;
+  client_set_state(list, c, CLOSING);
 
   switch(c->fd_state_[in]) {
   case ESTABLISHING: log_printf(ERROR, "client %d: socket %d is in the ESTABLISHING state???", c->fd_[0], c->fd_[in]); return 1; // assert() this??
@@ -374,89 +1021,431 @@ static int client_handle_buffer_flushed(client_t* c, int i)
   return 0;
 }
 
-int clients_read(clients_t* list, fd_set* set)
+static int client_recv(clients_t* list, client_t* c, int in, int out)
 {
-  if(!list)
+#ifdef HAVE_SPLICE
+  if(c->relay_ == RELAY_SPLICE) {
+    int len = splice(c->fd_[in], NULL, c->pipe_[out].fd_[1], NULL, c->write_buf_[out].length_ - c->write_buf_offset_[out], SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if(len < 0 && errno == EAGAIN && c->write_buf_offset_[out]) {
+      log_printf(DEBUG, "client %d: pipe towards %d is full", c->fd_[0], c->fd_[out]);
+      c->write_buf_[out].length_ = c->write_buf_offset_[out];
+    }
+    return len;
+  }
+#endif
+  buffer_t* buf = &(c->write_buf_[out]);
+  if(!buf->buf_)
+    return recv(c->fd_[in], list->scratch_.buf_, list->scratch_.length_, 0);
+  if(!c->write_buf_offset_[out])
+    c->write_buf_start_[out] = 0;
+
+  u_int32_t tail = c->write_buf_start_[out] + c->write_buf_offset_[out];
+  if(tail >= buf->length_)
+    return recv(c->fd_[in], &(buf->buf_[tail - buf->length_]), buf->length_ - c->write_buf_offset_[out], 0);
+  if(!c->write_buf_start_[out])
+    return recv(c->fd_[in], &(buf->buf_[tail]), buf->length_ - tail, 0);
+
+  struct iovec iov[2];
+  iov[0].iov_base = &(buf->buf_[tail]);
+  iov[0].iov_len = buf->length_ - tail;
+  iov[1].iov_base = buf->buf_;
+  iov[1].iov_len = c->write_buf_start_[out];
+  return readv(c->fd_[in], iov, 2);
+}
+
+static int client_send(client_t* c, int i)
+{
+#ifdef HAVE_SPLICE
+  if(c->relay_ == RELAY_SPLICE) {
+    int len = splice(c->pipe_[i].fd_[0], NULL, c->fd_[i], NULL, c->write_buf_offset_[i], SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if(len > 0)
+      c->write_buf_[i].length_ = c->pipe_[i].size_;
+    return len;
+  }
+#endif
+  buffer_t* buf = &(c->write_buf_[i]);
+  u_int32_t tail = c->write_buf_start_[i] + c->write_buf_offset_[i];
+  int len;
+  if(tail <= buf->length_)
+    len = send(c->fd_[i], &(buf->buf_[c->write_buf_start_[i]]), c->write_buf_offset_[i], 0);
+  else {
+    struct iovec iov[2];
+    iov[0].iov_base = &(buf->buf_[c->write_buf_start_[i]]);
+    iov[0].iov_len = buf->length_ - c->write_buf_start_[i];
+    iov[1].iov_base = buf->buf_;
+    iov[1].iov_len = tail - buf->length_;
+    len = writev(c->fd_[i], iov, 2);
+  }
+  if(len > 0)
+    c->write_buf_start_[i] = (c->write_buf_start_[i] + len) % buf->length_;
+  return len;
+}
+
+static void client_send_error(clients_t* list, client_t* c, int i)
+{
+  // TODO: the other socket might still have data pending....
+  if(i == 1 && errno == ECONNRESET)
+    backends_report(c->backends_, c->backend_, 0);
+  log_printf(INFO, "Error on send(): %s, removing client %d", strerror(errno), c->fd_[0]);
+  client_remove(list, c);
+}
+
+/* sends as much of the write buffer of socket i as it takes right now,
+   returns -1 if the client had to be removed */
+static int client_flush(clients_t* list, client_t* c, int i)
+{
+  log_printf(DEBUG, "calling send(%d)", c->fd_[i]);
+  int len = client_send(c, i);
+  if(len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS)) {
+    log_printf(DEBUG, "send(%d) would block", c->fd_[i]);
+    return 0;
+  }
+  if(len < 0) {
+    client_send_error(list, c, i);
     return -1;
+  }
 
-  slist_element_t* tmp = list->list_.first_;
-  while(tmp) {
-    client_t* c = (client_t*)tmp->data_;
-    tmp = tmp->next_;
-    if(c && (c->state_ == CONNECTED || c->state_ == CLOSING)) {
-      int i;
-      for(i=0; i<2; ++i) {
-        int in, out;
-        if(FD_ISSET(c->fd_[i], set)) {
-          in = i;
-          out = i ^ 1;
-        }
-        else continue;
-
-        log_printf(DEBUG, "calling recv(%d)", c->fd_[in]);
-        int len = recv(c->fd_[in], &(c->write_buf_[out].buf_[c->write_buf_offset_[out]]),  c->write_buf_[out].length_ - c->write_buf_offset_[out], 0);
-        if(len < 0) {
-              // TODO: the other socket might still have data pending....
-          log_printf(INFO, "Error on recv(): %s, removing client %d", strerror(errno), c->fd_[0]);
-          slist_remove(&(list->list_), c);
-          break;
-        }
-        else if(!len) {
-          if(client_handle_recv_null(c, in, out)) {
-            slist_remove(&(list->list_), c);
-            break;
-          }
-        }
-        else
-          c->write_buf_offset_[out] += len;
-      }
+  c->transferred_[i] += len;
+  if(c->bytes_)
+    c->bytes_->transferred_[i] += len;
+  c->last_active_ = timer_wheel_now(&(list->timers_));
+  if(c->write_buf_offset_[i] > len) {
+    c->write_buf_offset_[i] -= len;
+    return 0;
+  }
+  c->write_buf_offset_[i] = 0;
+  if(c->write_buf_[i].buf_) {
+    pool_free(c->write_buf_[i].buf_);
+    c->write_buf_[i].buf_ = NULL;
+  }
+  if(client_handle_buffer_flushed(c, i)) {
+    client_remove(list, c);
+    return -1;
+  }
+  return 0;
+}
+
+/* data received into the scratch buffer goes straight to the other side,
+   only what it doesn't take right away gets a buffer of its own */
+static int client_pass(clients_t* list, client_t* c, int out, int len)
+{
+  int sent = 0;
+  if(c->fd_state_[out] == ESTABLISHED || c->fd_state_[out] == RCV_STOPPED) {
+    log_printf(DEBUG, "calling send(%d)", c->fd_[out]);
+    sent = send(c->fd_[out], list->scratch_.buf_, len, 0);
+    /* a fast open connect that couldn't put the data into the SYN reports EINPROGRESS */
+    if(sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINPROGRESS) {
+      client_send_error(list, c, out);
+      return -1;
     }
+    if(sent < 0)
+      sent = 0;
+    c->transferred_[out] += sent;
+    if(c->bytes_)
+      c->bytes_->transferred_[out] += sent;
   }
+  if(sent == len)
+    return 0;
 
+  buffer_t* buf = &(c->write_buf_[out]);
+  buf->buf_ = pool_alloc(list->buffer_size_);
+  if(!buf->buf_) {
+    log_printf(ERROR, "unable to allocate write buffer, removing client %d", c->fd_[0]);
+    client_remove(list, c);
+    return -1;
+  }
+  memcpy(buf->buf_, &(list->scratch_.buf_[sent]), len - sent);
+  c->write_buf_start_[out] = 0;
+  c->write_buf_offset_[out] = len - sent;
   return 0;
 }
 
-int clients_write(clients_t* list, fd_set* set)
+static int client_read(clients_t* list, client_t* c)
 {
-  if(!list)
+  if(c->state_ == WAITING && (poller_ready(list->poller_, c->fd_[0]) & POLLER_READ) && client_wait(list, c)) {
+    client_remove(list, c);
     return -1;
+  }
+  if(c->state_ != CONNECTED && c->state_ != CLOSING)
+    return 0;
 
-  slist_element_t* tmp = list->list_.first_;
-  while(tmp) {
-    client_t* c = (client_t*)tmp->data_;
-    tmp = tmp->next_;
-    if(c && (c->state_ == CONNECTED || c->state_ == CLOSING)) {
-      int i;
-      for(i=0; i<2; ++i) {
-        if(FD_ISSET(c->fd_[i], set)) {
-          log_printf(DEBUG, "calling send(%d)", c->fd_[i]);
-          int len = send(c->fd_[i], c->write_buf_[i].buf_, c->write_buf_offset_[i], 0);
-          if(len < 0) {
-                // TODO: the other socket might still have data pending....
-            log_printf(INFO, "Error on send(): %s, removing client %d", strerror(errno), c->fd_[0]);
-            slist_remove(&(list->list_), c);
-            break;
-          }
-          else {
-            c->transferred_[i] += len;
-            if(c->write_buf_offset_[i] > len) {
-              memmove(c->write_buf_[i].buf_, &c->write_buf_[i].buf_[len], c->write_buf_offset_[i] - len);
-              c->write_buf_offset_[i] -= len;
-            }
-            else {
-              c->write_buf_offset_[i] = 0;
-              if(client_handle_buffer_flushed(c, i))
-                slist_remove(&(list->list_), c);
-            }
-          }
-        }
+  client_state_t state = c->state_;
+
+  int i;
+  for(i=0; i<2; ++i) {
+    int in, out;
+    if(poller_ready(list->poller_, c->fd_[i]) & POLLER_READ) {
+      in = i;
+      out = i ^ 1;
+    }
+    else continue;
+
+    log_printf(DEBUG, "calling recv(%d)", c->fd_[in]);
+    int relay_scratch = c->relay_ == RELAY_COPY && !c->write_buf_[out].buf_;
+    int len = client_recv(list, c, in, out);
+    if(len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      log_printf(DEBUG, "recv(%d) would block", c->fd_[in]);
+    }
+    else if(len < 0) {
+          // TODO: the other socket might still have data pending....
+      if(in == 1 && (errno == ECONNRESET || errno == ECONNREFUSED))
+        backends_report(c->backends_, c->backend_, 0);
+      log_printf(INFO, "Error on recv(): %s, removing client %d", strerror(errno), c->fd_[0]);
+      client_remove(list, c);
+      return -1;
+    }
+    else if(!len) {
+      if(client_handle_recv_null(list, c, in, out)) {
+        client_remove(list, c);
+        return -1;
+      }
+    }
+    else if(relay_scratch) {
+      c->last_active_ = timer_wheel_now(&(list->timers_));
+      if(client_pass(list, c, out, len))
+        return -1;
+    }
+    else {
+      c->write_buf_offset_[out] += len;
+      c->last_active_ = timer_wheel_now(&(list->timers_));
+      /* if nothing was queued before the other side is most likely writable,
+         sending right away saves waiting for the next round of the event loop */
+      if(c->write_buf_offset_[out] == (u_int32_t)len && (c->fd_state_[out] == ESTABLISHED || c->fd_state_[out] == RCV_STOPPED) &&
+         client_flush(list, c, out))
+        return -1;
+    }
+
+    if(client_update_interest(list, c)) {
+      client_remove(list, c);
+      return -1;
+    }
+  }
+  if(c->state_ != state)
+    client_update_timer(list, c);
+
+  return 0;
+}
+
+static int client_write(clients_t* list, client_t* c)
+{
+  if(c->state_ == WAITING)
+    return 0;
+  if(c->state_ == CONNECTING) {
+    int slot;
+    for(slot = 0; slot < CLIENT_CONNECT_ATTEMPTS && c->state_ == CONNECTING; ++slot) {
+      int fd = c->connect_.fd_[slot];
+      if(fd < 0 || !(poller_ready(list->poller_, fd) & POLLER_WRITE))
+        continue;
+
+      if(client_connect_check(list, c, slot)) {
+        client_remove(list, c);
+        return -1;
+      }
+    }
+    return 0;
+  }
+
+  int i;
+  for(i=0; i<2; ++i) {
+    if(poller_ready(list->poller_, c->fd_[i]) & POLLER_WRITE) {
+      if(client_flush(list, c, i))
+        return -1;
+      if(client_update_interest(list, c)) {
+        client_remove(list, c);
+        return -1;
       }
-    } else if(c && c->state_ == CONNECTING && FD_ISSET(c->fd_[1], set)) {
-      int ret = handle_connect(c, list->buffer_size_);
-      if(ret)
-        slist_remove(&(list->list_), c);
     }
   }
 
   return 0;
 }
+
+/* a failed operation which would only have had to wait is queued again
+   behind a poll for the socket */
+static int client_ring_retry(client_t* c, int op, int res)
+{
+  if(res != -EAGAIN && res != -EINTR && res != -EINPROGRESS)
+    return 0;
+
+  log_printf(DEBUG, "client %d: %s would block", c->fd_[0], (op & 1) ? "send" : "recv");
+  c->ring_wait_ |= 1 << op;
+  return 1;
+}
+
+static int client_ring_received(clients_t* list, client_t* c, int out, int res)
+{
+  int in = out ^ 1;
+  if(client_ring_retry(c, CLIENT_RING_OP(out, 0), res))
+    return 0;
+  if(res < 0) {
+    if(in == 1 && (res == -ECONNRESET || res == -ECONNREFUSED))
+      backends_report(c->backends_, c->backend_, 0);
+    log_printf(INFO, "Error on recv(): %s, removing client %d", strerror(-res), c->fd_[0]);
+    client_remove(list, c);
+    return -1;
+  }
+  if(!res) {
+    if(client_handle_recv_null(list, c, in, out)) {
+      client_remove(list, c);
+      return -1;
+    }
+    return 0;
+  }
+
+  c->write_buf_offset_[out] += res;
+  c->last_active_ = timer_wheel_now(&(list->timers_));
+  return 0;
+}
+
+static int client_ring_sent(clients_t* list, client_t* c, int i, int res)
+{
+  if(client_ring_retry(c, CLIENT_RING_OP(i, 1), res))
+    return 0;
+  if(res < 0) {
+    errno = -res;
+    client_send_error(list, c, i);
+    return -1;
+  }
+
+  c->transferred_[i] += res;
+  if(c->bytes_)
+    c->bytes_->transferred_[i] += res;
+  c->last_active_ = timer_wheel_now(&(list->timers_));
+  c->write_buf_start_[i] = (c->write_buf_start_[i] + res) % c->write_buf_[i].length_;
+  c->write_buf_offset_[i] -= res;
+  if(!c->write_buf_offset_[i] && client_handle_buffer_flushed(c, i)) {
+    client_remove(list, c);
+    return -1;
+  }
+  return 0;
+}
+
+static void clients_ring_complete(clients_t* list)
+{
+  clients_ring_t* r = &(list->ring_);
+  int i, num = poller_num_completed(list->poller_);
+  for(i = 0; i < num; ++i) {
+    const poller_completion_t* cp = poller_get_completed(list->poller_, i);
+    int slot = (int)(cp->data_ >> 2);
+    if(slot >= r->num_slots_ || !r->pending_[slot])
+      continue;
+
+    r->pending_[slot]--;
+    client_t* c = r->owners_[slot];
+    if(!c) {
+      if(!r->pending_[slot])
+        r->free_[r->num_free_++] = slot;
+      continue;
+    }
+
+    int op = (int)(cp->data_ & 3);
+    c->ring_ops_ &= ~(1 << op);
+    client_state_t state = c->state_;
+    int ret;
+    if(op & 1)
+      ret = client_ring_sent(list, c, op >> 1, cp->res_);
+    else
+      ret = client_ring_received(list, c, op >> 1, cp->res_);
+    if(ret)
+      continue;
+
+    if(client_ring_submit(list, c)) {
+      client_remove(list, c);
+      continue;
+    }
+    if(c->state_ != state)
+      client_update_timer(list, c);
+  }
+}
+
+int clients_handle_ready(clients_t* list)
+{
+  if(!list)
+    return -1;
+
+  if(list->ring_.num_slots_)
+    clients_ring_complete(list);
+
+  client_t* last = NULL;
+  int i, num = poller_num_reported(list->poller_);
+  for(i = 0; i < num; ++i) {
+    client_t* c = clients_find(list, poller_get_reported(list->poller_, i));
+    if(!c || c->ready_)
+      continue;
+
+    c->ready_ = 1;
+    c->ready_next_ = NULL;
+    if(last)
+      last->ready_next_ = c;
+    else
+      list->ready_ = c;
+    last = c;
+  }
+
+  while(list->ready_) {
+    client_t* c = list->ready_;
+    list->ready_ = c->ready_next_;
+    c->ready_ = 0;
+    if(!client_write(list, c))
+      client_read(list, c);
+  }
+
+  return 0;
+}
+
+int clients_next_timeout(clients_t* list)
+{
+  if(!list)
+    return -1;
+
+  return timer_wheel_next(&(list->timers_));
+}
+
+static void client_timeout(timer_entry_t* t, void* ctx)
+{
+  clients_t* list = (clients_t*)ctx;
+  client_t* c = (client_t*)t->data_;
+
+  if(c->state_ == CONNECTING && c->connect_.next_at_ && c->connect_.next_at_ <= timer_wheel_now(&(list->timers_))) {
+    log_printf(DEBUG, "client %d: connection attempt delay expired, trying next address", c->fd_[0]);
+    if(client_connect_start(list, c)) {
+      client_remove(list, c);
+      return;
+    }
+    if(c->state_ == CONNECTING)
+      client_update_timer(list, c);
+    return;
+  }
+
+  u_int64_t deadline = client_deadline(c);
+  if(!deadline)
+    return;
+  if(deadline > timer_wheel_now(&(list->timers_))) {
+    timer_wheel_set(&(list->timers_), t, deadline);
+    return;
+  }
+
+  const char* what = "idle";
+  switch(c->state_) {
+  case WAITING: what = "idle"; break;
+  case CONNECTING: what = "connect"; break;
+  case CONNECTED: what = "idle"; break;
+  case CLOSING: what = "linger"; break;
+  }
+  log_printf(INFO, "client %d: %s timeout expired, removing it", c->fd_[0], what);
+  if(c->state_ == CONNECTING) {
+    int i;
+    for(i = 0; i < CLIENT_CONNECT_ATTEMPTS; ++i)
+      if(c->connect_.fd_[i] >= 0)
+        backends_report(c->backends_, c->connect_.backend_[i], 0);
+  }
+  client_remove(list, c);
+}
+
+void clients_handle_timeouts(clients_t* list)
+{
+  if(!list)
+    return;
+
+  timer_wheel_advance(&(list->timers_), client_timeout, list);
+}
@@ -28,45 +28,137 @@
 #ifndef TCPPROXY_clients_h_INCLUDED
 #define TCPPROXY_clients_h_INCLUDED
 
-#include <sys/select.h>
-
-#include "slist.h"
 #include "tcp.h"
+#include "poller.h"
+#include "timer_wheel.h"
+#include "backend.h"
 
 #define BUFFER_LENGTH 102400
 
-enum client_state_enum { CONNECTING, CONNECTED, CLOSING };
+enum relay_type_enum { RELAY_COPY, RELAY_SPLICE };
+typedef enum relay_type_enum relay_type_t;
+
+#define PIPE_POOL_SIZE 256
+
+#define CLIENTS_RING_MEMORY (16 * 1024 * 1024)
+#define CLIENTS_RING_MIN_SLOTS 16
+
+typedef struct {
+  u_int8_t* base_;
+  size_t size_;
+  u_int32_t slot_size_;
+  int num_slots_;
+  int* free_;
+  int num_free_;
+  struct client_struct** owners_;
+  u_int8_t* pending_;
+} clients_ring_t;
+
+typedef struct {
+  int fd_[2];
+  u_int32_t size_;
+} relay_pipe_t;
+
+/* bytes relayed for the clients of one listener, the clients hold a
+   reference because they may outlive the listener after a reload */
+typedef struct {
+  u_int64_t transferred_[2];
+  int refcnt_;
+} client_bytes_t;
+
+#define CLIENT_CONNECT_ATTEMPTS 4
+#define CLIENT_CONNECT_ATTEMPT_DELAY 250
+#define CLIENT_CONNECT_RETRY_DELAY 250
+
+typedef struct {
+  int fd_[CLIENT_CONNECT_ATTEMPTS];
+  int backend_[CLIENT_CONNECT_ATTEMPTS];
+  int source_[CLIENT_CONNECT_ATTEMPTS];
+  int pending_;
+  int next_;
+  u_int64_t next_at_;
+  int retries_;
+  int source_retries_;
+  int source_full_;
+  u_int32_t hash_;
+  int error_;
+} client_connect_t;
+
+typedef struct {
+  u_int32_t connect_;
+  u_int32_t idle_;
+  u_int32_t linger_;
+} client_timeouts_t;
+
+enum client_state_enum { WAITING, CONNECTING, CONNECTED, CLOSING };
 typedef enum client_state_enum client_state_t;
 enum client_fd_state_enum { ESTABLISHING, ESTABLISHED, RCV_STOPPED, FIN_PENDING, FIN_LINGER, CLOSE_PENDING };
 typedef enum client_fd_state_enum client_fd_state_t;
 
-typedef struct {
+struct client_struct {
   int fd_[2];
   client_fd_state_t fd_state_[2];
   buffer_t write_buf_[2];
+  u_int32_t write_buf_start_[2];
   u_int32_t write_buf_offset_[2];
+  relay_type_t relay_;
+  relay_pipe_t pipe_[2];
+  backends_t* backends_;
+  client_bytes_t* bytes_;
+  int backend_;
+  int source_;
+  int ring_slot_;
+  int ring_ops_;
+  int ring_wait_;
+  client_connect_t connect_;
   client_state_t state_;
   u_int64_t transferred_[2];
-} client_t;
+  client_timeouts_t timeouts_;
+  timer_entry_t timer_;
+  u_int64_t since_;
+  u_int64_t last_active_;
+  u_int32_t syscalls_;
+  struct client_struct* prev_;
+  struct client_struct* next_;
+  int ready_;
+  struct client_struct* ready_next_;
+};
+typedef struct client_struct client_t;
 
 void clients_delete_element(void* e);
 
 typedef struct {
-  slist_t list_;
+  client_t* first_;
+  int length_;
+  int states_[4];
+  client_t* ready_;
+  timer_wheel_t timers_;
+  client_t** fds_;
+  int fds_len_;
   int32_t buffer_size_;
+  buffer_t scratch_;
+  u_int64_t setups_;
+  u_int64_t setup_syscalls_;
+  poller_t* poller_;
+  relay_pipe_t* pipe_pool_;
+  int pipe_pool_len_;
+  clients_ring_t ring_;
 } clients_t;
 
-int clients_init(clients_t* list, int32_t buffer_size);
+int clients_init(clients_t* list, int32_t buffer_size, poller_t* poller);
 void clients_clear(clients_t* list);
-int clients_add(clients_t* list, int fd, const tcp_endpoint_t remote_end, const tcp_endpoint_t source_end);
+client_bytes_t* client_bytes_new();
+client_bytes_t* client_bytes_ref(client_bytes_t* b);
+void client_bytes_unref(client_bytes_t* b);
+
+int clients_add(clients_t* list, int fd, const tcp_endpoint_t* peer, backends_t* backends, client_bytes_t* bytes, relay_type_t relay, const client_timeouts_t timeouts, const tcp_sockopts_t* sockopts);
 void clients_remove(clients_t* list, int fd);
 client_t* clients_find(clients_t* list, int fd);
 void clients_print(clients_t* list);
+const char* relay_type_to_string(relay_type_t relay);
 
-void clients_read_fds(clients_t* list, fd_set* set, int* max_fd);
-void clients_write_fds(clients_t* list, fd_set* set, int* max_fd);
-
-int clients_read(clients_t* list, fd_set* set);
-int clients_write(clients_t* list, fd_set* set);
+int clients_handle_ready(clients_t* list);
+int clients_next_timeout(clients_t* list);
+void clients_handle_timeouts(clients_t* list);
 
 #endif
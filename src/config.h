@@ -0,0 +1,22 @@
+/*
+ * tcpproxy config header
+ *
+ * this file was created automatically
+ * do not edit this file directly
+ * use ./configure instead
+ */
+
+#ifndef TCPPROXY_config_h_INCLUDED
+#define TCPPROXY_config_h_INCLUDED
+
+#define VERSION_STRING_0 "tcpproxy version trunk (git 702a47bbe1d3b68c39ec9f254cb415464bde106d)"
+#define VERSION_STRING_1 "built on vm, 18.10.2026 04:58:16 UTC"
+
+#define TARGET "Linux"
+#define PREFIX "/usr/local"
+#define BINDIR "/usr/local/bin"
+#define SYSTEMDDIR "/usr/lib/systemd/system"
+#define ETCDIR "/usr/local/etc"
+#define CONFFILE "/usr/local/etc/tcpproxy.conf"
+
+#endif
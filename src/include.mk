@@ -0,0 +1,18 @@
+# this file was created automatically
+# do not edit this file directly
+# use ./configure instead
+
+TARGET := Linux
+CC := gcc
+CFLAGS := -g -Wall -O2 -DHAVE_EPOLL -DHAVE_SPLICE -DHAVE_IO_URING -pthread
+LDFLAGS := -g -Wall -O2 -pthread
+STRIP := strip
+INSTALL := install
+RAGEL := ragel
+
+prefix := '/usr/local'
+BINDIR := '/usr/local/bin'
+SYSTEMDDIR := '/usr/lib/systemd/system'
+ETCDIR := '/usr/local/etc'
+MANDIR := '/usr/local/share/man'
+EXAMPLESDIR := '/usr/local/share/examples'
@@ -25,9 +25,11 @@
  *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include "datatypes.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
@@ -37,10 +39,10 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
-#include <sys/select.h>
 
 #include "listener.h"
 #include "tcp.h"
+#include "poller.h"
 #include "log.h"
 
 #include "clients.h"
@@ -53,97 +55,158 @@ void listeners_delete_element(void* e)
   listener_t* element = (listener_t*)e;
   if(element->fd_ >= 0)
     close(element->fd_);
+  backends_unref(element->backends_);
+  client_bytes_unref(element->bytes_);
+  resolver_release(element->entry_);
 
   free(e);
 }
 
 int listeners_init(listeners_t* list)
 {
-  return slist_init(list, &listeners_delete_element);
+  list->poller_ = NULL;
+  list->reuse_port_ = 0;
+  list->accept_budget_ = LISTENER_DEFAULT_ACCEPT_BUDGET;
+  list->max_clients_ = 0;
+  list->paused_ = 0;
+  list->resume_at_ = 0;
+  timer_wheel_init(&(list->timers_));
+  timer_entry_init(&(list->retry_timer_), list);
+  list->retry_delay_ = LISTENER_RETRY_DELAY;
+  list->retry_ = 0;
+  list->pauses_ = 0;
+  list->shed_ = 0;
+  list->reserve_fd_ = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  if(list->reserve_fd_ < 0)
+    log_printf(WARNING, "unable to open reserve file descriptor: %s", strerror(errno));
+  return slist_init(&(list->list_), &listeners_delete_element);
 }
 
 void listeners_clear(listeners_t* list)
 {
-  slist_clear(list);
+  timer_wheel_cancel(&(list->timers_), &(list->retry_timer_));
+  slist_clear(&(list->list_));
+  if(list->reserve_fd_ >= 0)
+    close(list->reserve_fd_);
+  list->reserve_fd_ = -1;
 }
 
-int listeners_add(listeners_t* list, const char* laddr, resolv_type_t lrt, const char* lport, const char* raddr, resolv_type_t rrt, const char* rport, const char* saddr)
+static int listener_register(listeners_t* list, listener_t* l)
+{
+  if(!list->poller_ || l->state_ != ACTIVE || list->paused_)
+    return 0;
+
+  return poller_set(list->poller_, l->fd_, POLLER_READ);
+}
+
+static void listener_unregister(listeners_t* list, listener_t* l)
+{
+  if(!list->poller_ || l->fd_ < 0)
+    return;
+
+  poller_set(list->poller_, l->fd_, 0);
+}
+
+void listeners_set_poller(listeners_t* list, poller_t* poller)
 {
   if(!list)
-    return -1;
+    return;
 
-  if(!lport) { log_printf(ERROR, "no local port specified"); return -1; }
-  if(!raddr) { log_printf(ERROR, "no remote address specified"); return -1; }
-  if(!rport) { log_printf(ERROR, "no remote port specified"); return -1; }
+  slist_element_t* tmp = list->list_.first_;
+  while(tmp) {
+    listener_t* l = (listener_t*)tmp->data_;
+    if(l)
+      listener_unregister(list, l);
+    tmp = tmp->next_;
+  }
+
+  list->poller_ = poller;
+  tmp = list->list_.first_;
+  while(tmp) {
+    listener_t* l = (listener_t*)tmp->data_;
+    if(l && listener_register(list, l))
+      log_printf(ERROR, "unable to add listener #%d to event loop", l->fd_);
+    tmp = tmp->next_;
+  }
+}
 
-// TODO: what if more than one address is returned here?
-  struct addrinfo* re = tcp_resolve_endpoint(raddr, rport, rrt, 0);
-  if(!re)
+int listeners_add(listeners_t* list, const char* laddr, resolv_type_t lrt, const char* lport, backends_t* backends, relay_type_t relay, int backlog, const client_timeouts_t timeouts, const tcp_sockopts_t* sockopts)
+{
+  if(!list)
     return -1;
 
-  struct addrinfo* se = NULL;
-  if(saddr) {
-    se = tcp_resolve_endpoint(saddr, NULL, rrt, 0);
-    if(!se) {
-      freeaddrinfo(re);
-      return -1;
-    }
+#ifndef HAVE_SPLICE
+  if(relay == RELAY_SPLICE) {
+    log_printf(WARNING, "splice relaying is not supported on this platform, falling back to copy");
+    relay = RELAY_COPY;
   }
+#endif
 
-  struct addrinfo* le = tcp_resolve_endpoint(laddr, lport, lrt, 1);
-  if(!le) {
-    freeaddrinfo(re);
-    if(se)
-      freeaddrinfo(se);
-    return -1;
+  if(backlog <= 0) {
+    log_printf(WARNING, "illegal backlog %d, using default backlog", backlog);
+    backlog = LISTENER_DEFAULT_BACKLOG;
   }
 
-  struct addrinfo* l = le;
-  int ret = 0;
-  while(l) {
+  if(!lport) { log_printf(ERROR, "no local port specified"); return -1; }
+  if(!backends || !backends->num_remotes_) { log_printf(ERROR, "no remote address specified"); return -1; }
+
+/* every listener holds the cache entry it was created from, this way an
+   unchanged hostname is still known, and doesn't block, on the next reload */
+  resolver_entry_t* le = resolver_lookup(laddr, lport, lrt, TCP_RESOLVE_PASSIVE | RESOLVER_NO_BACKGROUND);
+  if(!le)
+    return -1;
+
+  int i, ret = 0;
+  for(i = 0; i < le->len_; ++i) {
     listener_t* element = malloc(sizeof(listener_t));
     if(!element) {
       ret = -2;
       break;
     }
-    memset(&(element->remote_end_.addr_), 0, sizeof(element->remote_end_.addr_));
-    memcpy(&(element->remote_end_.addr_), re->ai_addr, re->ai_addrlen);
-    element->remote_end_.len_ = re->ai_addrlen;
-
-    memset(&(element->source_end_.addr_), 0, sizeof(element->source_end_.addr_));
-    if(se) {
-      memcpy(&(element->source_end_.addr_), se->ai_addr, se->ai_addrlen);
-      element->source_end_.len_ = se->ai_addrlen;
+    element->bytes_ = client_bytes_new();
+    if(!element->bytes_) {
+      free(element);
+      ret = -2;
+      break;
     }
-    else element->source_end_.addr_.ss_family = AF_UNSPEC;
+    element->backends_ = backends_ref(backends);
 
     memset(&(element->local_end_.addr_), 0, sizeof(element->local_end_.addr_));
-    memcpy(&(element->local_end_.addr_), l->ai_addr, l->ai_addrlen);
-    element->local_end_.len_ = l->ai_addrlen;
+    memcpy(&(element->local_end_.addr_), &(le->addrs_[i].addr_), le->addrs_[i].len_);
+    element->local_end_.len_ = le->addrs_[i].len_;
+    element->entry_ = resolver_ref(le);
+    element->relay_ = relay;
+    element->backlog_ = backlog;
+    element->timeouts_ = timeouts;
+    if(sockopts)
+      element->sockopts_ = *sockopts;
+    else
+      tcp_sockopts_init(&(element->sockopts_));
     element->state_ = NEW;
+    element->accepts_ = 0;
+    element->shed_ = 0;
     element->fd_ = -1;
 
-    if(slist_add(list, element) == NULL) {
+    if(slist_add(&(list->list_), element) == NULL) {
+      backends_unref(element->backends_);
+      client_bytes_unref(element->bytes_);
+      resolver_release(element->entry_);
       free(element);
       ret = -2;
       break;
     }
-
-    l = l->ai_next;
   }
-  freeaddrinfo(re);
-  if(se) freeaddrinfo(se);
-  freeaddrinfo(le);
+  resolver_release(le);
 
   return ret;
 }
 
-static int activate_listener(listener_t* l)
+static int activate_listener(listeners_t* list, listener_t* l)
 {
   if(!l || l->state_ != NEW)
     return -1;
 
-  l->fd_ = socket(l->local_end_.addr_.ss_family, SOCK_STREAM, 0);
+  l->fd_ = socket(l->local_end_.addr_.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
   if(l->fd_ < 0) {
     log_printf(ERROR, "Error on opening tcp socket: %s", strerror(errno));
     l->state_ = ZOMBIE;
@@ -157,11 +220,22 @@ static int activate_listener(listener_t* l)
     l->state_ = ZOMBIE;
     return -1;
   }
+#ifdef SO_REUSEPORT
+  if(list->reuse_port_) {
+    if(setsockopt(l->fd_, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))) {
+      log_printf(ERROR, "Error on setsockopt(SO_REUSEPORT): %s", strerror(errno));
+      l->state_ = ZOMBIE;
+      return -1;
+    }
+  }
+#endif
   if(l->local_end_.addr_.ss_family == AF_INET6) {
     if(setsockopt(l->fd_, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on)))
       log_printf(WARNING, "failed to set IPV6_V6ONLY socket option: %s", strerror(errno));
   }
 
+  tcp_set_sockopts(l->fd_, l->local_end_.addr_.ss_family, &(l->sockopts_), TCP_SOCKOPTS_BUFFERS | TCP_SOCKOPTS_LISTEN | TCP_SOCKOPTS_CONNECTION);
+
   char* ls = tcp_endpoint_to_string(l->local_end_);
   ret = bind(l->fd_, (struct sockaddr *)&(l->local_end_.addr_), l->local_end_.len_);
   if(ret) {
@@ -171,7 +245,7 @@ static int activate_listener(listener_t* l)
     return -1;
   }
 
-  ret = listen(l->fd_, 0);
+  ret = listen(l->fd_, l->backlog_);
   if(ret) {
     log_printf(ERROR, "Error on listen(): %s", strerror(errno));
     if(ls) free(ls);
@@ -181,9 +255,9 @@ static int activate_listener(listener_t* l)
 
   l->state_ = ACTIVE;
 
-  char* rs = tcp_endpoint_to_string(l->remote_end_);
-  char* ss = tcp_endpoint_to_string(l->source_end_);
-  log_printf(NOTICE, "listening on: %s (remote: %s%s%s)", ls ? ls:"(null)", rs ? rs:"(null)", ss ? " with source " : "", ss ? ss : "");
+  char* rs = backends_to_string(l->backends_);
+  char* ss = backends_source_to_string(l->backends_);
+  log_printf(NOTICE, "listening on: %s (remote: %s, %s%s%s)", ls ? ls:"(null)", rs ? rs:"(null)", balance_type_to_string(l->backends_->balance_), ss ? " with source " : "", ss ? ss : "");
   if(ls) free(ls);
   if(rs) free(rs);
   if(ss) free(ss);
@@ -199,11 +273,18 @@ static void update_listener(listener_t* dest, listener_t* src)
   dest->fd_ = src->fd_;
   src->fd_ = -1;
   dest->state_ = ACTIVE;
+  dest->accepts_ = src->accepts_;
+  dest->shed_ = src->shed_;
+  client_bytes_unref(dest->bytes_);
+  dest->bytes_ = client_bytes_ref(src->bytes_);
+  if(dest->backlog_ != src->backlog_ && listen(dest->fd_, dest->backlog_))
+    log_printf(WARNING, "unable to change backlog of listener #%d: %s", dest->fd_, strerror(errno));
+  tcp_set_sockopts(dest->fd_, dest->local_end_.addr_.ss_family, &(dest->sockopts_), TCP_SOCKOPTS_BUFFERS | TCP_SOCKOPTS_LISTEN | TCP_SOCKOPTS_CONNECTION);
 
   char* ls = tcp_endpoint_to_string(dest->local_end_);
-  char* rs = tcp_endpoint_to_string(dest->remote_end_);
-  char* ss = tcp_endpoint_to_string(dest->source_end_);
-  log_printf(NOTICE, "reusing %s with remote: %s%s%s", ls ? ls:"(null)", rs ? rs:"(null)", ss ? " and source " : "", ss ? ss : "");
+  char* rs = backends_to_string(dest->backends_);
+  char* ss = backends_source_to_string(dest->backends_);
+  log_printf(NOTICE, "reusing %s with remote: %s, %s%s%s", ls ? ls:"(null)", rs ? rs:"(null)", balance_type_to_string(dest->backends_->balance_), ss ? " and source " : "", ss ? ss : "");
   if(ls) free(ls);
   if(rs) free(rs);
   if(ss) free(ss);
@@ -214,7 +295,7 @@ static listener_t* find_zombie_listener(listeners_t* list, tcp_endpoint_t* local
   if(!list)
     return NULL;
 
-  slist_element_t* tmp = list->first_;
+  slist_element_t* tmp = list->list_.first_;
   while(tmp) {
     listener_t* l = (listener_t*)tmp->data_;
     if(l && l->state_ == ZOMBIE && l->local_end_.len_ == local_end->len_ &&
@@ -231,7 +312,7 @@ int listeners_update(listeners_t* list)
   if(!list)
     return 0;
 
-  slist_element_t* tmp = list->first_;
+  slist_element_t* tmp = list->list_.first_;
   while(tmp) {
     listener_t* l = (listener_t*)tmp->data_;
     if(l && l->state_ == ACTIVE)
@@ -240,7 +321,7 @@ int listeners_update(listeners_t* list)
   }
 
   int retval = 0;
-  tmp = list->first_;
+  tmp = list->list_.first_;
   while(tmp) {
     listener_t* l = (listener_t*)tmp->data_;
     int ret = 0;
@@ -248,21 +329,25 @@ int listeners_update(listeners_t* list)
       listener_t* tmp = find_zombie_listener(list, &(l->local_end_));
       if(tmp)
         update_listener(l, tmp);
-      else
-        ret = activate_listener(l);
+      else {
+        ret = activate_listener(list, l);
+        if(!ret)
+          ret = listener_register(list, l);
+      }
     }
     if(!retval) retval = ret;
     tmp = tmp->next_;
   }
 
   int cnt = 0;
-  tmp = list->first_;
+  tmp = list->list_.first_;
   while(tmp) {
     listener_t* l = (listener_t*)tmp->data_;
     tmp = tmp->next_;
     if(l && l->state_ == ZOMBIE) {
       cnt++;
-      slist_remove(list, l);
+      listener_unregister(list, l);
+      slist_remove(&(list->list_), l);
     }
   }
   log_printf(DEBUG, "%d listener zombies removed", cnt);
@@ -276,13 +361,13 @@ void listeners_revert(listeners_t* list)
     return;
 
   int cnt = 0;
-  slist_element_t* tmp = list->first_;
+  slist_element_t* tmp = list->list_.first_;
   while(tmp) {
     listener_t* l = (listener_t*)tmp->data_;
     tmp = tmp->next_;
     if(l && l->state_ == NEW) {
       cnt++;
-      slist_remove(list, l);
+      slist_remove(&(list->list_), l);
     }
   }
 
@@ -291,7 +376,12 @@ void listeners_revert(listeners_t* list)
 
 void listeners_remove(listeners_t* list, int fd)
 {
-  slist_remove(list, listeners_find(list, fd));
+  listener_t* l = listeners_find(list, fd);
+  if(!l)
+    return;
+
+  listener_unregister(list, l);
+  slist_remove(&(list->list_), l);
 }
 
 listener_t* listeners_find(listeners_t* list, int fd)
@@ -299,7 +389,7 @@ listener_t* listeners_find(listeners_t* list, int fd)
   if(!list)
     return NULL;
 
-  slist_element_t* tmp = list->first_;
+  slist_element_t* tmp = list->list_.first_;
   while(tmp) {
     listener_t* l = (listener_t*)tmp->data_;
     if(l && l->fd_ == fd)
@@ -315,68 +405,182 @@ void listeners_print(listeners_t* list)
   if(!list)
     return;
 
-  slist_element_t* tmp = list->first_;
+  slist_element_t* tmp = list->list_.first_;
   while(tmp) {
     listener_t* l = (listener_t*)tmp->data_;
     if(l) {
       char* ls = tcp_endpoint_to_string(l->local_end_);
-      char* rs = tcp_endpoint_to_string(l->remote_end_);
-      char* ss = tcp_endpoint_to_string(l->source_end_);
+      char* ss = backends_source_to_string(l->backends_);
       char state = '?';
       switch(l->state_) {
       case NEW: state = 'n'; break;
       case ACTIVE: state = 'a'; break;
       case ZOMBIE: state = 'z'; break;
       }
-      log_printf(NOTICE, "[%c] listener #%d: %s -> %s%s%s", state, l->fd_, ls ? ls : "(null)", rs ? rs : "(null)", ss ? " with source " : "", ss ? ss : "");
+      log_printf(NOTICE, "[%c] listener #%d: %s -> %d backend(s)%s%s (balance: %s, relay: %s, backlog: %d, timeouts: %u/%u/%us, %d retries, %llu shed)", state, l->fd_, ls ? ls : "(null)", backends_usable(l->backends_), ss ? " with source " : "", ss ? ss : "",
+                 balance_type_to_string(l->backends_->balance_), relay_type_to_string(l->relay_), l->backlog_, l->timeouts_.connect_ / 1000, l->timeouts_.idle_ / 1000, l->timeouts_.linger_ / 1000, l->backends_->retries_, (unsigned long long)l->shed_);
+      int i;
+      for(i = 0; i < l->backends_->len_; ++i) {
+        if(l->backends_->list_[i].stale_ && !l->backends_->list_[i].active_)
+          continue;
+        const char* health = "";
+        if(backends_ejected(l->backends_, i)) health = " (ejected)";
+        else if(l->backends_->list_[i].recovered_at_) health = " (slow start)";
+        char* rs = tcp_endpoint_to_string(l->backends_->list_[i].addr_);
+        log_printf(NOTICE, "      backend %s: weight %d, %d active, %d preconnected, %d failures%s%s", rs ? rs : "(null)", l->backends_->list_[i].weight_, l->backends_->list_[i].active_,
+                   backends_spares_ready(l->backends_, i), l->backends_->list_[i].failures_, l->backends_->list_[i].stale_ ? " (stale)" : "", health);
+        if(rs) free(rs);
+      }
       if(ls) free(ls);
-      if(rs) free(rs);
       if(ss) free(ss);
     }
     tmp = tmp->next_;
   }
+  log_printf(NOTICE, "%s new connections, paused %llu times, %llu connections shed", list->paused_ ? "not accepting" : "accepting",
+             (unsigned long long)list->pauses_, (unsigned long long)list->shed_);
 }
 
-void listeners_read_fds(listeners_t* list, fd_set* set, int* max_fd)
+/* running out of file descriptors may have nothing to do with the number
+   of clients (ENFILE is system wide, spares, probes and pipes need some
+   too), so in that case accepting is also retried after a backoff */
+static void listeners_pause(listeners_t* list, int clients, int retry, const char* reason)
 {
-  if(!list)
+  if(list->paused_)
     return;
 
-  slist_element_t* tmp = list->first_;
+  slist_element_t* tmp = list->list_.first_;
   while(tmp) {
     listener_t* l = (listener_t*)tmp->data_;
-    if(l && l->state_ == ACTIVE) {
-      FD_SET(l->fd_, set);
-      *max_fd = *max_fd > l->fd_ ? *max_fd : l->fd_;
-    }
+    if(l && l->state_ == ACTIVE)
+      listener_unregister(list, l);
+    tmp = tmp->next_;
+  }
+  list->paused_ = 1;
+  list->pauses_++;
+  list->resume_at_ = (clients * LISTENER_RESUME_PERCENT) / 100;
+  if(clients > 0 && list->resume_at_ >= clients)
+    list->resume_at_ = clients - 1;
+  log_printf(WARNING, "%s at %d clients, not accepting new connections until there are %d clients or less", reason, clients, list->resume_at_);
+  if(retry) {
+    log_printf(NOTICE, "retrying to accept new connections in %u ms", list->retry_delay_);
+    timer_wheel_set(&(list->timers_), &(list->retry_timer_), timer_wheel_now(&(list->timers_)) + list->retry_delay_);
+    list->retry_delay_ *= 2;
+    if(list->retry_delay_ > LISTENER_MAX_RETRY_DELAY)
+      list->retry_delay_ = LISTENER_MAX_RETRY_DELAY;
+  }
+}
+
+static void listeners_resume(listeners_t* list, int clients)
+{
+  if(!list->paused_)
+    return;
+
+  list->paused_ = 0;
+  list->retry_ = 0;
+  timer_wheel_cancel(&(list->timers_), &(list->retry_timer_));
+  slist_element_t* tmp = list->list_.first_;
+  while(tmp) {
+    listener_t* l = (listener_t*)tmp->data_;
+    if(l && listener_register(list, l))
+      log_printf(ERROR, "unable to add listener #%d to event loop", l->fd_);
     tmp = tmp->next_;
   }
+  log_printf(NOTICE, "accepting new connections again at %d clients (%llu connections shed so far)", clients, (unsigned long long)list->shed_);
+}
+
+static void listeners_retry(timer_entry_t* t, void* ctx)
+{
+  listeners_t* list = (listeners_t*)t->data_;
+  list->retry_ = 1;
 }
 
-int listeners_handle_accept(listeners_t* list, clients_t* clients, fd_set* set)
+int listeners_next_timeout(listeners_t* list)
 {
   if(!list)
     return -1;
 
-  slist_element_t* tmp = list->first_;
-  while(tmp) {
+  return timer_wheel_next(&(list->timers_));
+}
+
+void listeners_handle_timeouts(listeners_t* list)
+{
+  if(!list)
+    return;
+
+  timer_wheel_advance(&(list->timers_), listeners_retry, NULL);
+}
+
+static void listener_shed(listeners_t* list, listener_t* l)
+{
+  if(list->reserve_fd_ < 0)
+    return;
+
+  close(list->reserve_fd_);
+  int fd = accept4(l->fd_, NULL, NULL, SOCK_CLOEXEC);
+  if(fd >= 0) {
+    close(fd);
+    l->shed_++;
+    list->shed_++;
+  }
+  list->reserve_fd_ = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+int listeners_handle_accept(listeners_t* list, clients_t* clients)
+{
+  if(!list)
+    return -1;
+
+  if(list->paused_ && (clients->length_ <= list->resume_at_ || list->retry_))
+    listeners_resume(list, clients->length_);
+
+  slist_element_t* tmp = list->list_.first_;
+  while(tmp && !list->paused_) {
     listener_t* l = (listener_t*)tmp->data_;
-    if(l && FD_ISSET(l->fd_, set)) {
+    tmp = tmp->next_;
+    if(!l || l->state_ != ACTIVE || !(poller_ready(list->poller_, l->fd_) & POLLER_READ))
+      continue;
+
+    int cnt;
+    for(cnt = 0; cnt < list->accept_budget_; ++cnt) {
+      if(list->max_clients_ && clients->length_ >= list->max_clients_) {
+        listeners_pause(list, clients->length_, 0, "client limit reached");
+        break;
+      }
+
       tcp_endpoint_t remote_addr;
       remote_addr.len_ = sizeof(remote_addr.addr_);
-      int new_client = accept(l->fd_, (struct sockaddr *)&(remote_addr.addr_), &remote_addr.len_);
+      int new_client = accept4(l->fd_, (struct sockaddr *)&(remote_addr.addr_), &remote_addr.len_, SOCK_NONBLOCK | SOCK_CLOEXEC);
       if(new_client == -1) {
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+          break;
+        if(errno == EINTR || errno == ECONNABORTED)
+          continue;
+        if(errno == EMFILE || errno == ENFILE) {
+          log_printf(DEBUG, "Error on accept(): %s", strerror(errno));
+          listener_shed(list, l);
+          listeners_pause(list, clients->length_, 1, "out of file descriptors");
+          break;
+        }
         log_printf(ERROR, "Error on accept(): %s", strerror(errno));
-        return -1;
+        break;
+      }
+      l->accepts_++;
+      list->retry_delay_ = LISTENER_RETRY_DELAY;
+      if(log_enabled(INFO)) {
+        char* rs = tcp_endpoint_to_string(remote_addr);
+        log_printf(INFO, "new client from %s (fd=%d)", rs ? rs:"(null)", new_client);
+        if(rs) free(rs);
       }
-      char* rs = tcp_endpoint_to_string(remote_addr);
-      log_printf(INFO, "new client from %s (fd=%d)", rs ? rs:"(null)", new_client);
-      if(rs) free(rs);
-      FD_CLR(l->fd_, set);
 
-      clients_add(clients, new_client, l->remote_end_, l->source_end_);
+      if(clients_add(clients, new_client, &remote_addr, l->backends_, l->bytes_, l->relay_, l->timeouts_, &(l->sockopts_)) == -3) {
+        l->shed_++;
+        list->shed_++;
+        listeners_pause(list, clients->length_, 1, "out of file descriptors");
+        break;
+      }
     }
-    tmp = tmp->next_;
+    if(cnt >= list->accept_budget_)
+      log_printf(DEBUG, "accept budget of %d exhausted on listener #%d", list->accept_budget_, l->fd_);
   }
 
   return 0;
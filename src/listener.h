@@ -28,11 +28,19 @@
 #ifndef TCPPROXY_listener_h_INCLUDED
 #define TCPPROXY_listener_h_INCLUDED
 
-#include <sys/select.h>
-
 #include "slist.h"
 #include "tcp.h"
+#include "poller.h"
+#include "timer_wheel.h"
+#include "resolver.h"
 #include "clients.h"
+#include "backend.h"
+
+#define LISTENER_DEFAULT_BACKLOG SOMAXCONN
+#define LISTENER_DEFAULT_ACCEPT_BUDGET 64
+#define LISTENER_RESUME_PERCENT 90
+#define LISTENER_RETRY_DELAY 100
+#define LISTENER_MAX_RETRY_DELAY 5000
 
 enum listener_state_enum { NEW, ACTIVE, ZOMBIE };
 typedef enum listener_state_enum listener_state_t;
@@ -40,25 +48,50 @@ typedef enum listener_state_enum listener_state_t;
 typedef struct {
   int fd_;
   tcp_endpoint_t local_end_;
-  tcp_endpoint_t remote_end_;
-  tcp_endpoint_t source_end_;
+  resolver_entry_t* entry_;
+  backends_t* backends_;
+  client_bytes_t* bytes_;
+  relay_type_t relay_;
+  int backlog_;
+  client_timeouts_t timeouts_;
+  tcp_sockopts_t sockopts_;
   listener_state_t state_;
+  u_int64_t accepts_;
+  u_int64_t shed_;
 } listener_t;
 
 void listeners_delete_element(void* e);
 
-typedef slist_t listeners_t;
+typedef struct {
+  slist_t list_;
+  poller_t* poller_;
+  int reuse_port_;
+  int accept_budget_;
+  int max_clients_;
+  int reserve_fd_;
+  int paused_;
+  int resume_at_;
+  timer_wheel_t timers_;
+  timer_entry_t retry_timer_;
+  u_int32_t retry_delay_;
+  int retry_;
+  u_int64_t pauses_;
+  u_int64_t shed_;
+} listeners_t;
 
 int listeners_init(listeners_t* list);
+void listeners_set_poller(listeners_t* list, poller_t* poller);
 void listeners_clear(listeners_t* list);
-int listeners_add(listeners_t* list, const char* laddr, resolv_type_t lrt, const char* lport, const char* raddr, resolv_type_t rrt, const char* rport, const char* saddr);
+int listeners_add(listeners_t* list, const char* laddr, resolv_type_t lrt, const char* lport, backends_t* backends, relay_type_t relay, int backlog, const client_timeouts_t timeouts, const tcp_sockopts_t* sockopts);
 int listeners_update(listeners_t* list);
 void listeners_revert(listeners_t* list);
 void listeners_remove(listeners_t* list, int fd);
 listener_t* listeners_find(listeners_t* list, int fd);
 void listeners_print(listeners_t* list);
 
-void listeners_read_fds(listeners_t* list, fd_set* set, int* max_fd);
-int listeners_handle_accept(listeners_t* list, clients_t* clients, fd_set* set);
+int listeners_next_timeout(listeners_t* list);
+void listeners_handle_timeouts(listeners_t* list);
+
+int listeners_handle_accept(listeners_t* list, clients_t* clients);
 
 #endif
@@ -209,6 +209,12 @@ int log_add_target(const char* conf)
   return ret;
 }
 
+/* lets callers skip formatting arguments nobody is going to see */
+int log_enabled(log_prio_t prio)
+{
+  return stdlog.max_prio_ >= prio;
+}
+
 void log_printf(log_prio_t prio, const char* fmt, ...)
 {
   if(stdlog.max_prio_ < prio)
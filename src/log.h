@@ -76,6 +76,7 @@ void log_init();
 void log_close();
 void update_max_prio();
 int log_add_target(const char* conf);
+int log_enabled(log_prio_t prio);
 void log_printf(log_prio_t prio, const char* fmt, ...);
 void log_print_hex_dump(log_prio_t prio, const uint8_t* buf, uint32_t len);
 
@@ -36,6 +36,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <sys/socket.h>
 
 #define PARSE_BOOL_PARAM(SHORT, LONG, VALUE)             \
     else if(!strcmp(str,SHORT) || !strcmp(str,LONG))     \
@@ -133,6 +135,57 @@
       i++;                                               \
     }
 
+#define PARSE_EVENT_BACKEND(SHORT, LONG, VALUE)          \
+    else if(!strcmp(str,SHORT) || !strcmp(str,LONG))     \
+    {                                                    \
+      if(argc < 1 || argv[i+1][0] == '-')                \
+        return i;                                        \
+      if(!strcmp(argv[i+1], "select"))                   \
+        VALUE = POLLER_SELECT;                           \
+      else if(!strcmp(argv[i+1], "epoll"))               \
+        VALUE = POLLER_EPOLL;                            \
+      else if(!strcmp(argv[i+1], "io_uring"))            \
+        VALUE = POLLER_IO_URING;                         \
+      else                                               \
+        return i+1;                                      \
+      argc--;                                            \
+      i++;                                               \
+    }
+
+#define PARSE_RELAY_TYPE(SHORT, LONG, VALUE)             \
+    else if(!strcmp(str,SHORT) || !strcmp(str,LONG))     \
+    {                                                    \
+      if(argc < 1 || argv[i+1][0] == '-')                \
+        return i;                                        \
+      if(!strcmp(argv[i+1], "copy"))                     \
+        VALUE = RELAY_COPY;                              \
+      else if(!strcmp(argv[i+1], "splice"))              \
+        VALUE = RELAY_SPLICE;                            \
+      else                                               \
+        return i+1;                                      \
+      argc--;                                            \
+      i++;                                               \
+    }
+
+#define PARSE_BALANCE_TYPE(SHORT, LONG, VALUE)           \
+    else if(!strcmp(str,SHORT) || !strcmp(str,LONG))     \
+    {                                                    \
+      if(argc < 1 || argv[i+1][0] == '-')                \
+        return i;                                        \
+      if(!strcmp(argv[i+1], "round-robin"))              \
+        VALUE = BALANCE_ROUND_ROBIN;                     \
+      else if(!strcmp(argv[i+1], "weighted"))            \
+        VALUE = BALANCE_WEIGHTED;                        \
+      else if(!strcmp(argv[i+1], "least-conn"))          \
+        VALUE = BALANCE_LEAST_CONN;                      \
+      else if(!strcmp(argv[i+1], "hash-source"))         \
+        VALUE = BALANCE_HASH_SOURCE;                     \
+      else                                               \
+        return i+1;                                      \
+      argc--;                                            \
+      i++;                                               \
+    }
+
 int options_parse_hex_string(const char* hex, buffer_t* buffer)
 {
   if(!hex || !buffer)
@@ -204,8 +257,30 @@ int options_parse(options_t* opt, int argc, char* argv[])
     PARSE_RESOLV_TYPE("-R","--remote-resolv", opt->rresolv_type_)
     PARSE_STRING_PARAM("-o","--remote-port", opt->remote_port_)
     PARSE_STRING_PARAM("-s","--source-addr", opt->source_addr_)
+    PARSE_BALANCE_TYPE("-A","--balance", opt->balance_)
+    PARSE_INT_PARAM("-N","--dns-ttl", opt->dns_ttl_)
+    PARSE_INT_PARAM("-x","--max-fails", opt->max_fails_)
+    PARSE_INT_PARAM("-X","--fail-timeout", opt->fail_timeout_)
+    PARSE_INT_PARAM("-k","--health-check", opt->health_check_)
+    PARSE_INT_PARAM("-S","--slow-start", opt->slow_start_)
+    PARSE_RELAY_TYPE("-m","--relay", opt->relay_)
+    PARSE_INT_PARAM("-B","--backlog", opt->backlog_)
+    PARSE_INT_PARAM("-T","--connect-timeout", opt->connect_timeout_)
+    PARSE_INT_PARAM("-I","--idle-timeout", opt->idle_timeout_)
+    PARSE_INT_PARAM("-F","--linger-timeout", opt->linger_timeout_)
+    PARSE_INT_PARAM("-y","--connect-retries", opt->connect_retries_)
+    PARSE_INT_PARAM("-O","--preconnect", opt->preconnect_)
+    PARSE_BOOL_PARAM("-E","--defer-connect", opt->defer_connect_)
     PARSE_STRING_PARAM("-c","--config", opt->config_file_)
     PARSE_INT_PARAM("-b","--buffer-size", opt->buffer_size_)
+    PARSE_EVENT_BACKEND("-e","--event-backend", opt->event_backend_)
+    PARSE_INT_PARAM("-w","--workers", opt->workers_)
+    PARSE_INT_PARAM("-a","--accept-budget", opt->accept_budget_)
+    PARSE_INT_PARAM("-M","--max-clients", opt->max_clients_)
+    PARSE_INT_PARAM("-z","--pool-size", opt->pool_size_)
+    PARSE_INT_PARAM("-Z","--pool-prewarm", opt->pool_prewarm_)
+    PARSE_BOOL_PARAM("-H","--hugepages", opt->hugepages_)
+    PARSE_STRING_PARAM("-Q","--admin", opt->admin_)
     else
       return i;
   }
@@ -242,6 +317,87 @@ void options_parse_post(options_t* opt)
     log_printf(WARNING, "illegal buffer size %d using default buffer size", opt->buffer_size_);
     opt->buffer_size_ = 10 * 1024;
   }
+
+  if(opt->connect_timeout_ < 0 || opt->idle_timeout_ < 0 || opt->linger_timeout_ < 0) {
+    log_printf(WARNING, "illegal negative timeout, disabling it");
+    if(opt->connect_timeout_ < 0) opt->connect_timeout_ = 0;
+    if(opt->idle_timeout_ < 0) opt->idle_timeout_ = 0;
+    if(opt->linger_timeout_ < 0) opt->linger_timeout_ = 0;
+  }
+
+  if(opt->connect_retries_ < 0) {
+    log_printf(WARNING, "illegal number of connect retries %d, not retrying", opt->connect_retries_);
+    opt->connect_retries_ = 0;
+  }
+
+  if(opt->preconnect_ < 0) {
+    log_printf(WARNING, "illegal number of preconnected sockets %d, disabling preconnect", opt->preconnect_);
+    opt->preconnect_ = 0;
+  }
+
+  if(opt->dns_ttl_ < 0) {
+    log_printf(WARNING, "illegal dns ttl %d, resolving remote hostnames only once", opt->dns_ttl_);
+    opt->dns_ttl_ = 0;
+  }
+
+  if(opt->max_fails_ < 0) {
+    log_printf(WARNING, "illegal number of failures %d, never ejecting backends", opt->max_fails_);
+    opt->max_fails_ = 0;
+  }
+
+  if(opt->fail_timeout_ <= 0) {
+    log_printf(WARNING, "illegal fail timeout %d using default fail timeout", opt->fail_timeout_);
+    opt->fail_timeout_ = BACKEND_DEFAULT_FAIL_TIMEOUT;
+  }
+
+  if(opt->health_check_ < 0 || opt->slow_start_ < 0) {
+    log_printf(WARNING, "illegal negative health check interval or slow start, disabling it");
+    if(opt->health_check_ < 0) opt->health_check_ = 0;
+    if(opt->slow_start_ < 0) opt->slow_start_ = 0;
+  }
+
+  if(opt->workers_ <= 0) {
+    log_printf(WARNING, "illegal number of workers %d using a single worker", opt->workers_);
+    opt->workers_ = 1;
+  }
+
+  if(opt->accept_budget_ <= 0) {
+    log_printf(WARNING, "illegal accept budget %d using default accept budget", opt->accept_budget_);
+    opt->accept_budget_ = LISTENER_DEFAULT_ACCEPT_BUDGET;
+  }
+
+  if(opt->max_clients_ < 0) {
+    log_printf(WARNING, "illegal client limit %d, not limiting the number of clients", opt->max_clients_);
+    opt->max_clients_ = 0;
+  }
+
+  if(opt->pool_size_ < 0) {
+    log_printf(WARNING, "illegal pool size %d disabling the buffer pool", opt->pool_size_);
+    opt->pool_size_ = 0;
+  }
+
+  if(opt->pool_prewarm_ < 0) {
+    log_printf(WARNING, "illegal number of clients to prewarm the pool for %d, not prewarming", opt->pool_prewarm_);
+    opt->pool_prewarm_ = 0;
+  }
+#ifndef SO_REUSEPORT
+  if(opt->workers_ > 1) {
+    log_printf(WARNING, "multiple workers are not supported on this platform (no SO_REUSEPORT), using a single worker");
+    opt->workers_ = 1;
+  }
+#endif
+
+  if(opt->admin_ && opt->admin_[0] != '/' && strrchr(opt->admin_, ':')) {
+    char* port = strrchr(opt->admin_, ':') + 1;
+    char* end;
+    errno = 0;
+    long p = strtol(port, &end, 10);
+    if(errno || end == port || *end || p < 1 || p > 65536 - opt->workers_) {
+      log_printf(WARNING, "illegal admin port '%s' for %d worker(s), disabling the admin socket", port, opt->workers_);
+      free(opt->admin_);
+      opt->admin_ = NULL;
+    }
+  }
 }
 
 void options_default(options_t* opt)
@@ -262,9 +418,35 @@ void options_default(options_t* opt)
   opt->rresolv_type_ = ANY;
   opt->remote_port_ = NULL;
   opt->source_addr_ = NULL;
+  opt->balance_ = BALANCE_ROUND_ROBIN;
+  opt->dns_ttl_ = RESOLVER_DEFAULT_TTL;
+  opt->max_fails_ = BACKEND_DEFAULT_MAX_FAILS;
+  opt->fail_timeout_ = BACKEND_DEFAULT_FAIL_TIMEOUT;
+  opt->health_check_ = 0;
+  opt->slow_start_ = 0;
+  opt->relay_ = RELAY_COPY;
+  opt->backlog_ = LISTENER_DEFAULT_BACKLOG;
+  opt->connect_timeout_ = 0;
+  opt->idle_timeout_ = 0;
+  opt->linger_timeout_ = 0;
+  opt->connect_retries_ = BACKEND_DEFAULT_RETRIES;
+  opt->preconnect_ = 0;
+  opt->defer_connect_ = 0;
   opt->config_file_ = NULL;
   string_list_init(&opt->log_targets_);
   opt->buffer_size_ = 10 * 1024;
+#ifdef HAVE_EPOLL
+  opt->event_backend_ = POLLER_EPOLL;
+#else
+  opt->event_backend_ = POLLER_SELECT;
+#endif
+  opt->workers_ = 1;
+  opt->accept_budget_ = LISTENER_DEFAULT_ACCEPT_BUDGET;
+  opt->max_clients_ = 0;
+  opt->pool_size_ = 32;
+  opt->pool_prewarm_ = 0;
+  opt->hugepages_ = 0;
+  opt->admin_ = NULL;
   opt->debug_ = 0;
 }
 
@@ -296,6 +478,8 @@ void options_clear(options_t* opt)
     free(opt->source_addr_);
   if(opt->config_file_)
     free(opt->config_file_);
+  if(opt->admin_)
+    free(opt->admin_);
 }
 
 void options_print_usage()
@@ -317,8 +501,32 @@ void options_print_usage()
   printf("         [-r|--remote-addr] <host>            remote address to connect to\n");
   printf("         [-R|--remote-resolv] (ipv4|4|ipv6|6) set IPv4 or IPv6 only resolving for remote and source address\n");
   printf("         [-o|--remote-port] <service>         remote port to connect to\n");
-  printf("         [-s|--source-addr] <host>            source address to connect from\n");
+  printf("         [-s|--source-addr] <host>[,...]      source addresses or networks to connect from\n");
+  printf("         [-A|--balance] (round-robin|weighted|least-conn|hash-source)\n");
+  printf("                                              how to spread connections over all addresses of the remote\n");
+  printf("         [-N|--dns-ttl] <seconds>             re-resolve remote hostnames after this time, 0 resolves only once\n");
+  printf("         [-x|--max-fails] <num>               eject a backend after this many consecutive failures, 0 never ejects\n");
+  printf("         [-X|--fail-timeout] <seconds>        how long to eject a failing backend before trying it again\n");
+  printf("         [-k|--health-check] <seconds>        probe backends with a connect at this interval, 0 disables probing\n");
+  printf("         [-S|--slow-start] <seconds>          ramp up the share of recovered backends over this time\n");
+  printf("         [-m|--relay] (copy|splice)           how to move data between the client and the remote\n");
+  printf("         [-B|--backlog] <num>                 size of the listen queue\n");
+  printf("         [-T|--connect-timeout] <seconds>     give up connecting to the remote after this time\n");
+  printf("         [-I|--idle-timeout] <seconds>        close connections without any traffic for this time\n");
+  printf("         [-F|--linger-timeout] <seconds>      close half-closed connections without any traffic for this time\n");
+  printf("         [-y|--connect-retries] <num>         try this many other backends before giving up on a client\n");
+  printf("         [-O|--preconnect] <num>              keep this many idle connections to every backend for new clients\n");
+  printf("         [-E|--defer-connect]                 connect to the backend only once the client has sent data\n");
   printf("         [-b|--buffer-size] <size>            size of transmit buffers\n");
+  printf("         [-e|--event-backend] (epoll|io_uring|select)\n");
+  printf("                                              event notification mechanism to use\n");
+  printf("         [-w|--workers] <num>                 number of worker processes\n");
+  printf("         [-a|--accept-budget] <num>           maximum number of connections to accept per listener and loop iteration\n");
+  printf("         [-M|--max-clients] <num>             stop accepting connections while this many clients are connected\n");
+  printf("         [-z|--pool-size] <megabytes>         maximum size of the buffer pool, 0 disables it\n");
+  printf("         [-Z|--pool-prewarm] <num>            fill the buffer pool for this many clients at startup\n");
+  printf("         [-H|--hugepages]                     back the buffer pool with hugepages\n");
+  printf("         [-Q|--admin] <path>|<host>:<port>    serve metrics on this UNIX socket or TCP address\n");
   printf("         [-c|--config] <file>                 configuration file\n");
 }
 
@@ -358,7 +566,29 @@ void options_print(options_t* opt)
   else printf("rresolv_type: Both\n");
   printf("remote_port: '%s'\n", opt->remote_port_);
   printf("source_addr: '%s'\n", opt->source_addr_);
+  printf("balance: %s\n", balance_type_to_string(opt->balance_));
+  printf("dns-ttl: %d\n", opt->dns_ttl_);
+  printf("max-fails: %d\n", opt->max_fails_);
+  printf("fail-timeout: %d\n", opt->fail_timeout_);
+  printf("health-check: %d\n", opt->health_check_);
+  printf("slow-start: %d\n", opt->slow_start_);
+  printf("relay: %s\n", relay_type_to_string(opt->relay_));
+  printf("backlog: %d\n", opt->backlog_);
+  printf("connect-timeout: %d\n", opt->connect_timeout_);
+  printf("idle-timeout: %d\n", opt->idle_timeout_);
+  printf("linger-timeout: %d\n", opt->linger_timeout_);
+  printf("connect-retries: %d\n", opt->connect_retries_);
+  printf("preconnect: %d\n", opt->preconnect_);
+  printf("defer-connect: %s\n", !opt->defer_connect_ ? "false" : "true");
   printf("buffer-size: %d\n", opt->buffer_size_);
+  printf("event-backend: %s\n", poller_backend_to_string(opt->event_backend_));
+  printf("workers: %d\n", opt->workers_);
+  printf("accept-budget: %d\n", opt->accept_budget_);
+  printf("max-clients: %d\n", opt->max_clients_);
+  printf("pool-size: %d\n", opt->pool_size_);
+  printf("pool-prewarm: %d\n", opt->pool_prewarm_);
+  printf("hugepages: %s\n", !opt->hugepages_ ? "false" : "true");
+  printf("admin: '%s'\n", opt->admin_);
   printf("config_file: '%s'\n", opt->config_file_);
   printf("debug: %s\n", !opt->debug_ ? "false" : "true");
 }
@@ -31,6 +31,10 @@
 #include "string_list.h"
 #include "datatypes.h"
 #include "tcp.h"
+#include "poller.h"
+#include "clients.h"
+#include "backend.h"
+#include "listener.h"
 
 struct options_struct {
   char* progname_;
@@ -47,8 +51,30 @@ struct options_struct {
   resolv_type_t rresolv_type_;
   char* remote_port_;
   char* source_addr_;
+  balance_type_t balance_;
+  int dns_ttl_;
+  int max_fails_;
+  int fail_timeout_;
+  int health_check_;
+  int slow_start_;
+  relay_type_t relay_;
+  int backlog_;
+  int connect_timeout_;
+  int idle_timeout_;
+  int linger_timeout_;
+  int connect_retries_;
+  int preconnect_;
+  int defer_connect_;
   char* config_file_;
   int32_t buffer_size_;
+  poller_backend_t event_backend_;
+  int workers_;
+  int accept_budget_;
+  int max_clients_;
+  int pool_size_;
+  int pool_prewarm_;
+  int hugepages_;
+  char* admin_;
   int debug_;
 };
 typedef struct options_struct options_t;
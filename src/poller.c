@@ -0,0 +1,838 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "datatypes.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/select.h>
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+#ifdef HAVE_IO_URING
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "poller.h"
+#include "log.h"
+
+static void poller_report(poller_t* p, int fd, int events)
+{
+  if(!events)
+    return;
+  if(!p->ready_[fd])
+    p->reported_[p->num_reported_++] = fd;
+  p->ready_[fd] |= events;
+}
+
+#ifdef HAVE_IO_URING
+
+#define POLLER_RING_ENTRIES 4096
+#define POLLER_RING_ARMED 0x01
+#define POLLER_RING_DIRTY 0x02
+#define POLLER_RING_TIMEOUT_DATA ((u_int64_t)-1)
+#define POLLER_RING_IGNORE_DATA ((u_int64_t)-2)
+#define POLLER_RING_IO_DATA ((u_int64_t)1 << 63)
+#define POLLER_RING_LINK_DATA ((u_int64_t)1 << 62)
+#define POLLER_RING_POLL_DATA(gen, fd) ((((u_int64_t)(gen) & 0x7FFFFFFF) << 32) | (u_int32_t)(fd))
+
+struct poller_ring_struct {
+  int fd_;
+  void* sq_ptr_;
+  size_t sq_size_;
+  void* cq_ptr_;
+  size_t cq_size_;
+  struct io_uring_sqe* sqes_;
+  size_t sqes_size_;
+  unsigned* sq_head_;
+  unsigned* sq_tail_;
+  unsigned* sq_mask_;
+  unsigned* sq_array_;
+  unsigned sq_entries_;
+  unsigned sq_tail_local_;
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned* cq_mask_;
+  struct io_uring_cqe* cqes_;
+  u_int32_t* gen_;
+  u_int8_t* flags_;
+  int* dirty_;
+  int num_dirty_;
+  poller_completion_t* completed_;
+  int num_completed_;
+  int max_completed_;
+  struct __kernel_timespec ts_;
+};
+typedef struct poller_ring_struct poller_ring_t;
+
+static void poller_ring_clear(poller_t* p)
+{
+  poller_ring_t* r = (poller_ring_t*)p->ring_;
+  if(!r)
+    return;
+
+  if(r->sqes_)
+    munmap(r->sqes_, r->sqes_size_);
+  if(r->cq_ptr_ && r->cq_ptr_ != r->sq_ptr_)
+    munmap(r->cq_ptr_, r->cq_size_);
+  if(r->sq_ptr_)
+    munmap(r->sq_ptr_, r->sq_size_);
+  if(r->fd_ >= 0)
+    close(r->fd_);
+  if(r->gen_)
+    free(r->gen_);
+  if(r->flags_)
+    free(r->flags_);
+  if(r->dirty_)
+    free(r->dirty_);
+  if(r->completed_)
+    free(r->completed_);
+  free(r);
+  p->ring_ = NULL;
+}
+
+static int poller_ring_init(poller_t* p)
+{
+  poller_ring_t* r = malloc(sizeof(poller_ring_t));
+  if(!r)
+    return -2;
+  memset(r, 0, sizeof(poller_ring_t));
+  p->ring_ = r;
+
+  /* completions are only needed while waiting for them, deferring the work
+     until then saves interrupting the process whenever an operation finishes,
+     older kernels don't know about these flags and refuse them */
+  unsigned setup_flags[] = {
+#if defined(IORING_SETUP_DEFER_TASKRUN)
+    IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+#endif
+#if defined(IORING_SETUP_COOP_TASKRUN)
+    IORING_SETUP_COOP_TASKRUN,
+#endif
+    0 };
+  struct io_uring_params params;
+  unsigned i;
+  for(i = 0; i < sizeof(setup_flags) / sizeof(setup_flags[0]); ++i) {
+    memset(&params, 0, sizeof(params));
+    params.flags = setup_flags[i];
+    r->fd_ = syscall(__NR_io_uring_setup, POLLER_RING_ENTRIES, &params);
+    if(r->fd_ >= 0 || errno != EINVAL)
+      break;
+  }
+  if(r->fd_ < 0) {
+    log_printf(ERROR, "Error on io_uring_setup(): %s", strerror(errno));
+    poller_ring_clear(p);
+    return -1;
+  }
+
+  r->sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  r->cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if(params.features & IORING_FEAT_SINGLE_MMAP) {
+    if(r->cq_size_ > r->sq_size_)
+      r->sq_size_ = r->cq_size_;
+    r->cq_size_ = r->sq_size_;
+  }
+
+  r->sq_ptr_ = mmap(NULL, r->sq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd_, IORING_OFF_SQ_RING);
+  if(r->sq_ptr_ == MAP_FAILED) {
+    r->sq_ptr_ = NULL;
+    log_printf(ERROR, "mmap() of io_uring submission ring failed: %s", strerror(errno));
+    poller_ring_clear(p);
+    return -1;
+  }
+  if(params.features & IORING_FEAT_SINGLE_MMAP)
+    r->cq_ptr_ = r->sq_ptr_;
+  else {
+    r->cq_ptr_ = mmap(NULL, r->cq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd_, IORING_OFF_CQ_RING);
+    if(r->cq_ptr_ == MAP_FAILED) {
+      r->cq_ptr_ = NULL;
+      log_printf(ERROR, "mmap() of io_uring completion ring failed: %s", strerror(errno));
+      poller_ring_clear(p);
+      return -1;
+    }
+  }
+  r->sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes_ = mmap(NULL, r->sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd_, IORING_OFF_SQES);
+  if(r->sqes_ == MAP_FAILED) {
+    r->sqes_ = NULL;
+    log_printf(ERROR, "mmap() of io_uring submission entries failed: %s", strerror(errno));
+    poller_ring_clear(p);
+    return -1;
+  }
+
+  u_int8_t* sq = (u_int8_t*)r->sq_ptr_;
+  r->sq_head_ = (unsigned*)(sq + params.sq_off.head);
+  r->sq_tail_ = (unsigned*)(sq + params.sq_off.tail);
+  r->sq_mask_ = (unsigned*)(sq + params.sq_off.ring_mask);
+  r->sq_array_ = (unsigned*)(sq + params.sq_off.array);
+  r->sq_entries_ = params.sq_entries;
+  r->sq_tail_local_ = *(r->sq_tail_);
+
+  u_int8_t* cq = (u_int8_t*)r->cq_ptr_;
+  r->cq_head_ = (unsigned*)(cq + params.cq_off.head);
+  r->cq_tail_ = (unsigned*)(cq + params.cq_off.tail);
+  r->cq_mask_ = (unsigned*)(cq + params.cq_off.ring_mask);
+  r->cqes_ = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+  return 0;
+}
+
+static int poller_ring_grow(poller_t* p, int size)
+{
+  poller_ring_t* r = (poller_ring_t*)p->ring_;
+
+  u_int32_t* gen = realloc(r->gen_, size * sizeof(u_int32_t));
+  if(!gen)
+    return -2;
+  r->gen_ = gen;
+  memset(&(r->gen_[p->size_]), 0, (size - p->size_) * sizeof(u_int32_t));
+
+  u_int8_t* flags = realloc(r->flags_, size);
+  if(!flags)
+    return -2;
+  r->flags_ = flags;
+  memset(&(r->flags_[p->size_]), 0, size - p->size_);
+
+  int* dirty = realloc(r->dirty_, size * sizeof(int));
+  if(!dirty)
+    return -2;
+  r->dirty_ = dirty;
+
+  return 0;
+}
+
+static int poller_ring_enter(poller_ring_t* r, unsigned min_complete, unsigned flags)
+{
+  unsigned to_submit = r->sq_tail_local_ - __atomic_load_n(r->sq_head_, __ATOMIC_ACQUIRE);
+  return syscall(__NR_io_uring_enter, r->fd_, to_submit, min_complete, flags, NULL, 0);
+}
+
+/* makes sure the next num submissions fit into the queue, linked submissions
+   must not be split up by flushing the queue in between */
+static int poller_ring_reserve(poller_ring_t* r, unsigned num)
+{
+  if(r->sq_tail_local_ - __atomic_load_n(r->sq_head_, __ATOMIC_ACQUIRE) + num > r->sq_entries_) {
+    if(poller_ring_enter(r, 0, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      log_printf(ERROR, "Error on io_uring_enter(): %s", strerror(errno));
+      return -1;
+    }
+    if(r->sq_tail_local_ - __atomic_load_n(r->sq_head_, __ATOMIC_ACQUIRE) + num > r->sq_entries_) {
+      log_printf(ERROR, "io_uring submission queue is full");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static struct io_uring_sqe* poller_ring_get_sqe(poller_ring_t* r)
+{
+  if(poller_ring_reserve(r, 1))
+    return NULL;
+
+  unsigned idx = r->sq_tail_local_ & *(r->sq_mask_);
+  struct io_uring_sqe* sqe = &(r->sqes_[idx]);
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  r->sq_array_[idx] = idx;
+  r->sq_tail_local_++;
+  __atomic_store_n(r->sq_tail_, r->sq_tail_local_, __ATOMIC_RELEASE);
+  return sqe;
+}
+
+static int poller_set_ring(poller_t* p, int fd, int events)
+{
+  poller_ring_t* r = (poller_ring_t*)p->ring_;
+
+  if(r->flags_[fd] & POLLER_RING_ARMED) {
+    struct io_uring_sqe* sqe = poller_ring_get_sqe(r);
+    if(!sqe)
+      return -1;
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = POLLER_RING_POLL_DATA(r->gen_[fd], fd);
+    sqe->user_data = POLLER_RING_IGNORE_DATA;
+    r->flags_[fd] &= ~POLLER_RING_ARMED;
+  }
+  r->gen_[fd]++;
+
+  if(events && !(r->flags_[fd] & POLLER_RING_DIRTY)) {
+    r->flags_[fd] |= POLLER_RING_DIRTY;
+    r->dirty_[r->num_dirty_++] = fd;
+  }
+  return 0;
+}
+
+static int poller_ring_complete(poller_ring_t* r, u_int64_t data, int res)
+{
+  if(r->num_completed_ >= r->max_completed_) {
+    int max = r->max_completed_ ? r->max_completed_ * 2 : 1024;
+    poller_completion_t* completed = realloc(r->completed_, max * sizeof(poller_completion_t));
+    if(!completed)
+      return -2;
+    r->completed_ = completed;
+    r->max_completed_ = max;
+  }
+  r->completed_[r->num_completed_].data_ = data;
+  r->completed_[r->num_completed_].res_ = res;
+  r->num_completed_++;
+  return 0;
+}
+
+static int poller_wait_ring(poller_t* p, int timeout)
+{
+  poller_ring_t* r = (poller_ring_t*)p->ring_;
+  r->num_completed_ = 0;
+  int i;
+  for(i = 0; i < r->num_dirty_; ++i) {
+    int fd = r->dirty_[i];
+    r->flags_[fd] &= ~POLLER_RING_DIRTY;
+    if(!p->interest_[fd] || (r->flags_[fd] & POLLER_RING_ARMED))
+      continue;
+
+    struct io_uring_sqe* sqe = poller_ring_get_sqe(r);
+    if(!sqe) {
+      r->num_dirty_ = 0;
+      return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    if(p->interest_[fd] & POLLER_READ)
+      sqe->poll32_events |= POLLIN;
+    if(p->interest_[fd] & POLLER_WRITE)
+      sqe->poll32_events |= POLLOUT;
+    sqe->user_data = POLLER_RING_POLL_DATA(r->gen_[fd], fd);
+    r->flags_[fd] |= POLLER_RING_ARMED;
+  }
+  r->num_dirty_ = 0;
+
+  if(timeout >= 0) {
+    struct io_uring_sqe* sqe = poller_ring_get_sqe(r);
+    if(!sqe)
+      return -1;
+    r->ts_.tv_sec = timeout / 1000;
+    r->ts_.tv_nsec = (timeout % 1000) * 1000000;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (u_int64_t)(unsigned long)&(r->ts_);
+    sqe->len = 1;
+    sqe->off = 1;
+    sqe->user_data = POLLER_RING_TIMEOUT_DATA;
+  }
+
+  if(poller_ring_enter(r, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EBUSY)
+    return -1;
+
+  unsigned head = *(r->cq_head_);
+  unsigned tail = __atomic_load_n(r->cq_tail_, __ATOMIC_ACQUIRE);
+  for(; head != tail; ++head) {
+    struct io_uring_cqe* cqe = &(r->cqes_[head & *(r->cq_mask_)]);
+    if(cqe->user_data == POLLER_RING_TIMEOUT_DATA || cqe->user_data == POLLER_RING_IGNORE_DATA)
+      continue;
+    if(cqe->user_data & POLLER_RING_IO_DATA) {
+      if(!(cqe->user_data & POLLER_RING_LINK_DATA) && poller_ring_complete(r, cqe->user_data & ~POLLER_RING_IO_DATA, cqe->res)) {
+        /* leaving the entry in the queue, it is picked up again next time */
+        log_printf(ERROR, "unable to store io_uring completion");
+        break;
+      }
+      continue;
+    }
+
+    int fd = (int)(cqe->user_data & 0xFFFFFFFF);
+    if(fd >= p->size_ || cqe->user_data != POLLER_RING_POLL_DATA(r->gen_[fd], fd))
+      continue;
+
+    r->flags_[fd] &= ~POLLER_RING_ARMED;
+    if(!(r->flags_[fd] & POLLER_RING_DIRTY)) {
+      r->flags_[fd] |= POLLER_RING_DIRTY;
+      r->dirty_[r->num_dirty_++] = fd;
+    }
+    if(cqe->res <= 0)
+      continue;
+
+    int events = 0;
+    if(cqe->res & POLLIN)
+      events |= POLLER_READ;
+    if(cqe->res & POLLOUT)
+      events |= POLLER_WRITE;
+    if(cqe->res & (POLLERR | POLLHUP))
+      events |= p->interest_[fd];
+    poller_report(p, fd, events);
+  }
+  __atomic_store_n(r->cq_head_, head, __ATOMIC_RELEASE);
+
+  return p->num_reported_;
+}
+
+static int poller_io_submit_ring(poller_t* p, int write, int fd, void* addr, u_int32_t len, u_int64_t data, int wait)
+{
+  poller_ring_t* r = (poller_ring_t*)p->ring_;
+  if(poller_ring_reserve(r, wait ? 2 : 1))
+    return -1;
+
+  struct io_uring_sqe* sqe;
+  if(wait) {
+    sqe = poller_ring_get_sqe(r);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = write ? POLLOUT : POLLIN;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = POLLER_RING_IO_DATA | POLLER_RING_LINK_DATA | data;
+  }
+  sqe = poller_ring_get_sqe(r);
+  sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+  sqe->fd = fd;
+  sqe->addr = (u_int64_t)(unsigned long)addr;
+  sqe->len = len;
+  sqe->off = 0;
+  sqe->buf_index = 0;
+  sqe->user_data = POLLER_RING_IO_DATA | data;
+  return 0;
+}
+
+static void poller_io_cancel_ring(poller_t* p, u_int64_t data)
+{
+  poller_ring_t* r = (poller_ring_t*)p->ring_;
+  if(poller_ring_reserve(r, 2))
+    return;
+
+  /* a linked poll is cancelled as well, this fails the operation waiting for it */
+  int i;
+  for(i = 0; i < 2; ++i) {
+    struct io_uring_sqe* sqe = poller_ring_get_sqe(r);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = POLLER_RING_IO_DATA | (i ? POLLER_RING_LINK_DATA : 0) | data;
+    sqe->user_data = POLLER_RING_IGNORE_DATA;
+  }
+}
+#endif
+
+int poller_init(poller_t* p, poller_backend_t backend)
+{
+  if(!p)
+    return -1;
+
+  p->backend_ = backend;
+  p->size_ = 0;
+  p->interest_ = NULL;
+  p->ready_ = NULL;
+  p->reported_ = NULL;
+  p->num_reported_ = 0;
+  p->max_fd_ = -1;
+  FD_ZERO(&(p->read_set_));
+  FD_ZERO(&(p->write_set_));
+  p->epoll_fd_ = -1;
+  p->events_ = NULL;
+  p->ring_ = NULL;
+
+#ifdef HAVE_IO_URING
+  if(backend == POLLER_IO_URING) {
+    int ret = poller_ring_init(p);
+    if(ret == -2)
+      return ret;
+    if(ret) {
+#ifdef HAVE_EPOLL
+      log_printf(WARNING, "io_uring is not usable, falling back to epoll event backend");
+      backend = POLLER_EPOLL;
+#else
+      log_printf(WARNING, "io_uring is not usable, falling back to select event backend");
+      backend = POLLER_SELECT;
+#endif
+      p->backend_ = backend;
+    }
+  }
+#endif
+
+  switch(backend) {
+  case POLLER_SELECT: break;
+  case POLLER_EPOLL: {
+#ifdef HAVE_EPOLL
+    p->epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    if(p->epoll_fd_ < 0) {
+      log_printf(ERROR, "Error on epoll_create1(): %s", strerror(errno));
+      return -1;
+    }
+    p->events_ = malloc(POLLER_MAX_EVENTS * sizeof(struct epoll_event));
+    if(!p->events_) {
+      close(p->epoll_fd_);
+      p->epoll_fd_ = -1;
+      return -2;
+    }
+    break;
+#else
+    log_printf(ERROR, "epoll event backend is not supported on this platform");
+    return -1;
+#endif
+  }
+  case POLLER_IO_URING: {
+#ifndef HAVE_IO_URING
+    log_printf(ERROR, "io_uring event backend is not supported on this platform");
+    return -1;
+#endif
+    break;
+  }
+  }
+
+  log_printf(INFO, "using %s event backend", poller_backend_to_string(backend));
+  return 0;
+}
+
+void poller_clear(poller_t* p)
+{
+  if(!p)
+    return;
+
+#ifdef HAVE_IO_URING
+  poller_ring_clear(p);
+#endif
+  if(p->epoll_fd_ >= 0)
+    close(p->epoll_fd_);
+  p->epoll_fd_ = -1;
+  if(p->events_)
+    free(p->events_);
+  p->events_ = NULL;
+  if(p->interest_)
+    free(p->interest_);
+  p->interest_ = NULL;
+  if(p->ready_)
+    free(p->ready_);
+  p->ready_ = NULL;
+  if(p->reported_)
+    free(p->reported_);
+  p->reported_ = NULL;
+  p->num_reported_ = 0;
+  p->size_ = 0;
+  p->max_fd_ = -1;
+}
+
+static int poller_grow(poller_t* p, int fd)
+{
+  int size = p->size_ ? p->size_ : 64;
+  while(size <= fd)
+    size *= 2;
+
+  u_int8_t* interest = realloc(p->interest_, size);
+  if(!interest)
+    return -2;
+  p->interest_ = interest;
+
+  u_int8_t* ready = realloc(p->ready_, size);
+  if(!ready)
+    return -2;
+  p->ready_ = ready;
+
+  int* reported = realloc(p->reported_, size * sizeof(int));
+  if(!reported)
+    return -2;
+  p->reported_ = reported;
+
+#ifdef HAVE_IO_URING
+  if(p->ring_ && poller_ring_grow(p, size))
+    return -2;
+#endif
+
+  memset(&(p->interest_[p->size_]), 0, size - p->size_);
+  memset(&(p->ready_[p->size_]), 0, size - p->size_);
+  p->size_ = size;
+  return 0;
+}
+
+static int poller_set_select(poller_t* p, int fd, int events)
+{
+  if(fd >= FD_SETSIZE) {
+    log_printf(ERROR, "file descriptor %d exceeds FD_SETSIZE (%d), use the epoll event backend", fd, FD_SETSIZE);
+    return -1;
+  }
+
+  if(events & POLLER_READ)
+    FD_SET(fd, &(p->read_set_));
+  else
+    FD_CLR(fd, &(p->read_set_));
+
+  if(events & POLLER_WRITE)
+    FD_SET(fd, &(p->write_set_));
+  else
+    FD_CLR(fd, &(p->write_set_));
+
+  if(events && fd > p->max_fd_)
+    p->max_fd_ = fd;
+  else if(!events && fd == p->max_fd_) {
+    while(p->max_fd_ >= 0 && !p->interest_[p->max_fd_])
+      p->max_fd_--;
+  }
+  return 0;
+}
+
+#ifdef HAVE_EPOLL
+static int poller_set_epoll(poller_t* p, int fd, int old_events, int events)
+{
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.data.fd = fd;
+  if(events & POLLER_READ)
+    ev.events |= EPOLLIN;
+  if(events & POLLER_WRITE)
+    ev.events |= EPOLLOUT;
+
+  int op = EPOLL_CTL_MOD;
+  if(!old_events)
+    op = EPOLL_CTL_ADD;
+  else if(!events)
+    op = EPOLL_CTL_DEL;
+
+  int ret = epoll_ctl(p->epoll_fd_, op, fd, &ev);
+  if(ret && op == EPOLL_CTL_MOD && errno == ENOENT)
+    ret = epoll_ctl(p->epoll_fd_, EPOLL_CTL_ADD, fd, &ev);
+  else if(ret && op == EPOLL_CTL_ADD && errno == EEXIST)
+    ret = epoll_ctl(p->epoll_fd_, EPOLL_CTL_MOD, fd, &ev);
+  else if(ret && op == EPOLL_CTL_DEL && (errno == ENOENT || errno == EBADF))
+    ret = 0;
+
+  if(ret) {
+    log_printf(ERROR, "Error on epoll_ctl(%d): %s", fd, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+#endif
+
+int poller_set(poller_t* p, int fd, int events)
+{
+  if(!p || fd < 0)
+    return -1;
+
+  if(fd >= p->size_) {
+    if(!events)
+      return 0;
+    if(poller_grow(p, fd))
+      return -2;
+  }
+
+  int old_events = p->interest_[fd];
+  if(old_events == events)
+    return 0;
+
+  int ret = 0;
+  p->interest_[fd] = events;
+  switch(p->backend_) {
+  case POLLER_SELECT: ret = poller_set_select(p, fd, events); break;
+#ifdef HAVE_EPOLL
+  case POLLER_EPOLL: ret = poller_set_epoll(p, fd, old_events, events); break;
+#endif
+#ifdef HAVE_IO_URING
+  case POLLER_IO_URING: ret = poller_set_ring(p, fd, events); break;
+#endif
+  default: ret = -1; break;
+  }
+  if(ret) {
+    p->interest_[fd] = old_events;
+    return ret;
+  }
+
+  p->ready_[fd] &= events;
+  return 0;
+}
+
+static int poller_wait_select(poller_t* p, int timeout)
+{
+  fd_set readfds, writefds;
+  memcpy(&readfds, &(p->read_set_), sizeof(readfds));
+  memcpy(&writefds, &(p->write_set_), sizeof(writefds));
+
+  struct timeval tv, *tvp = NULL;
+  if(timeout >= 0) {
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+    tvp = &tv;
+  }
+
+  int ret = select(p->max_fd_ + 1, &readfds, &writefds, NULL, tvp);
+  if(ret <= 0)
+    return ret;
+
+  int fd;
+  for(fd = 0; fd <= p->max_fd_; ++fd) {
+    int events = 0;
+    if(FD_ISSET(fd, &readfds))
+      events |= POLLER_READ;
+    if(FD_ISSET(fd, &writefds))
+      events |= POLLER_WRITE;
+    poller_report(p, fd, events);
+  }
+  return p->num_reported_;
+}
+
+#ifdef HAVE_EPOLL
+static int poller_wait_epoll(poller_t* p, int timeout)
+{
+  struct epoll_event* events = (struct epoll_event*)p->events_;
+  int ret = epoll_wait(p->epoll_fd_, events, POLLER_MAX_EVENTS, timeout);
+  if(ret <= 0)
+    return ret;
+
+  int i;
+  for(i = 0; i < ret; ++i) {
+    int fd = events[i].data.fd;
+    if(fd >= p->size_)
+      continue;
+    int ev = 0;
+    if(events[i].events & EPOLLIN)
+      ev |= POLLER_READ;
+    if(events[i].events & EPOLLOUT)
+      ev |= POLLER_WRITE;
+    if(events[i].events & (EPOLLERR | EPOLLHUP))
+      ev |= p->interest_[fd];
+    poller_report(p, fd, ev);
+  }
+  return p->num_reported_;
+}
+#endif
+
+int poller_wait(poller_t* p, int timeout)
+{
+  if(!p)
+    return -1;
+
+  int i;
+  for(i = 0; i < p->num_reported_; ++i)
+    p->ready_[p->reported_[i]] = 0;
+  p->num_reported_ = 0;
+
+  switch(p->backend_) {
+  case POLLER_SELECT: return poller_wait_select(p, timeout);
+#ifdef HAVE_EPOLL
+  case POLLER_EPOLL: return poller_wait_epoll(p, timeout);
+#endif
+#ifdef HAVE_IO_URING
+  case POLLER_IO_URING: return poller_wait_ring(p, timeout);
+#endif
+  default: break;
+  }
+  return -1;
+}
+
+int poller_ready(poller_t* p, int fd)
+{
+  if(!p || fd < 0 || fd >= p->size_)
+    return 0;
+
+  return p->ready_[fd] & p->interest_[fd];
+}
+
+int poller_num_reported(poller_t* p)
+{
+  if(!p)
+    return 0;
+
+  return p->num_reported_;
+}
+
+int poller_get_reported(poller_t* p, int idx)
+{
+  if(!p || idx < 0 || idx >= p->num_reported_)
+    return -1;
+
+  return p->reported_[idx];
+}
+
+/* the data path on top of io_uring: a single buffer is registered with the
+   kernel, reads and writes using parts of it are queued and submitted
+   together with the next wait, the results show up as completions */
+int poller_io_register(poller_t* p, void* base, size_t len)
+{
+#ifdef HAVE_IO_URING
+  if(!p || p->backend_ != POLLER_IO_URING)
+    return -1;
+
+  poller_ring_t* r = (poller_ring_t*)p->ring_;
+  struct iovec iov;
+  iov.iov_base = base;
+  iov.iov_len = len;
+  if(syscall(__NR_io_uring_register, r->fd_, IORING_REGISTER_BUFFERS, &iov, 1) < 0)
+    return -1;
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+int poller_io_submit(poller_t* p, int write, int fd, void* addr, u_int32_t len, u_int64_t data, int wait)
+{
+#ifdef HAVE_IO_URING
+  if(!p || p->backend_ != POLLER_IO_URING || fd < 0)
+    return -1;
+
+  return poller_io_submit_ring(p, write, fd, addr, len, data, wait);
+#else
+  return -1;
+#endif
+}
+
+void poller_io_cancel(poller_t* p, u_int64_t data)
+{
+#ifdef HAVE_IO_URING
+  if(p && p->backend_ == POLLER_IO_URING)
+    poller_io_cancel_ring(p, data);
+#endif
+}
+
+int poller_num_completed(poller_t* p)
+{
+#ifdef HAVE_IO_URING
+  if(p && p->backend_ == POLLER_IO_URING)
+    return ((poller_ring_t*)p->ring_)->num_completed_;
+#endif
+  return 0;
+}
+
+const poller_completion_t* poller_get_completed(poller_t* p, int idx)
+{
+  if(idx < 0 || idx >= poller_num_completed(p))
+    return NULL;
+
+#ifdef HAVE_IO_URING
+  return &(((poller_ring_t*)p->ring_)->completed_[idx]);
+#else
+  return NULL;
+#endif
+}
+
+const char* poller_backend_to_string(poller_backend_t backend)
+{
+  switch(backend) {
+  case POLLER_SELECT: return "select";
+  case POLLER_EPOLL: return "epoll";
+  case POLLER_IO_URING: return "io_uring";
+  }
+  return "unknown";
+}
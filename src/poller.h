@@ -0,0 +1,77 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCPPROXY_poller_h_INCLUDED
+#define TCPPROXY_poller_h_INCLUDED
+
+#include <sys/types.h>
+#include <sys/select.h>
+
+#define POLLER_READ 0x01
+#define POLLER_WRITE 0x02
+
+enum poller_backend_enum { POLLER_SELECT, POLLER_EPOLL, POLLER_IO_URING };
+typedef enum poller_backend_enum poller_backend_t;
+
+#define POLLER_MAX_EVENTS 1024
+
+typedef struct {
+  u_int64_t data_;
+  int res_;
+} poller_completion_t;
+
+struct poller_struct {
+  poller_backend_t backend_;
+  int size_;
+  u_int8_t* interest_;
+  u_int8_t* ready_;
+  int* reported_;
+  int num_reported_;
+  int max_fd_;
+  fd_set read_set_;
+  fd_set write_set_;
+  int epoll_fd_;
+  void* events_;
+  void* ring_;
+};
+typedef struct poller_struct poller_t;
+
+int poller_init(poller_t* p, poller_backend_t backend);
+void poller_clear(poller_t* p);
+int poller_set(poller_t* p, int fd, int events);
+int poller_wait(poller_t* p, int timeout);
+int poller_ready(poller_t* p, int fd);
+int poller_num_reported(poller_t* p);
+int poller_get_reported(poller_t* p, int idx);
+int poller_io_register(poller_t* p, void* base, size_t len);
+int poller_io_submit(poller_t* p, int write, int fd, void* addr, u_int32_t len, u_int64_t data, int wait);
+void poller_io_cancel(poller_t* p, u_int64_t data);
+int poller_num_completed(poller_t* p);
+const poller_completion_t* poller_get_completed(poller_t* p, int idx);
+const char* poller_backend_to_string(poller_backend_t backend);
+
+#endif
@@ -0,0 +1,253 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include "datatypes.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "pool.h"
+#include "log.h"
+
+#define POOL_NO_CLASS 0xFFFF
+
+static pool_t stdpool;
+
+void pool_init(size_t max_size, int hugepages)
+{
+  memset(&stdpool, 0, sizeof(stdpool));
+  stdpool.max_size_ = max_size;
+  stdpool.hugepages_ = hugepages;
+}
+
+static int pool_get_class(size_t size)
+{
+  int i;
+  for(i = 0; i < stdpool.num_classes_; ++i)
+    if(stdpool.classes_[i].size_ == size)
+      return i;
+
+  if(!stdpool.max_size_ || stdpool.num_classes_ >= POOL_MAX_CLASSES)
+    return POOL_NO_CLASS;
+
+  pool_class_t* cls = &(stdpool.classes_[stdpool.num_classes_]);
+  memset(cls, 0, sizeof(pool_class_t));
+  cls->size_ = size;
+  return stdpool.num_classes_++;
+}
+
+static void* pool_map_slab(size_t len)
+{
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_POPULATE
+  flags |= MAP_POPULATE;
+#endif
+  void* slab;
+#ifdef MAP_HUGETLB
+  if(stdpool.hugepages_ == 1) {
+    slab = mmap(NULL, len, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+    if(slab != MAP_FAILED)
+      return slab;
+
+    log_printf(WARNING, "unable to map %zu bytes of hugepages: %s, falling back to transparent hugepages", len, strerror(errno));
+    stdpool.hugepages_ = 2;
+  }
+#endif
+#if defined(MADV_HUGEPAGE) && defined(MAP_POPULATE)
+  if(stdpool.hugepages_)
+    flags &= ~MAP_POPULATE;
+#endif
+  slab = mmap(NULL, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if(slab == MAP_FAILED) {
+    log_printf(ERROR, "Error on mmap(): %s", strerror(errno));
+    return NULL;
+  }
+#ifdef MADV_HUGEPAGE
+  if(stdpool.hugepages_) {
+    madvise(slab, len, MADV_HUGEPAGE);
+    memset(slab, 0, len);
+  }
+#endif
+  return slab;
+}
+
+static int pool_grow(int idx)
+{
+  pool_class_t* cls = &(stdpool.classes_[idx]);
+  size_t chunk = sizeof(pool_chunk_t) + cls->size_;
+  chunk = (chunk + sizeof(pool_chunk_t) - 1) & ~(sizeof(pool_chunk_t) - 1);
+
+  size_t align = stdpool.hugepages_ ? POOL_HUGEPAGE_SIZE : POOL_SLAB_SIZE;
+  size_t len = chunk * POOL_SLAB_CHUNKS;
+  if(len < align)
+    len = align;
+  len = (len + align - 1) & ~(align - 1);
+  if(stdpool.size_ + len > stdpool.max_size_)
+    return -1;
+
+  if(stdpool.num_slabs_ >= stdpool.max_slabs_) {
+    int max_slabs = stdpool.max_slabs_ ? stdpool.max_slabs_ * 2 : 16;
+    void** slabs = realloc(stdpool.slabs_, max_slabs * sizeof(void*));
+    if(!slabs)
+      return -2;
+    stdpool.slabs_ = slabs;
+    size_t* slab_sizes = realloc(stdpool.slab_sizes_, max_slabs * sizeof(size_t));
+    if(!slab_sizes)
+      return -2;
+    stdpool.slab_sizes_ = slab_sizes;
+    stdpool.max_slabs_ = max_slabs;
+  }
+
+  u_int8_t* slab = pool_map_slab(len);
+  if(!slab)
+    return -2;
+  stdpool.slabs_[stdpool.num_slabs_] = slab;
+  stdpool.slab_sizes_[stdpool.num_slabs_] = len;
+  stdpool.num_slabs_++;
+  stdpool.size_ += len;
+
+  size_t off;
+  for(off = 0; off + chunk <= len; off += chunk) {
+    pool_chunk_t* c = (pool_chunk_t*)(slab + off);
+    c->next_ = cls->free_;
+    cls->free_ = c;
+    cls->free_len_++;
+  }
+  log_printf(DEBUG, "pool: mapped %zu byte slab for %zu byte chunks (%zu of %zu bytes reserved)", len, cls->size_, stdpool.size_, stdpool.max_size_);
+  return 0;
+}
+
+int pool_prewarm(size_t size, u_int32_t num)
+{
+  int idx = pool_get_class(size);
+  if(idx == POOL_NO_CLASS)
+    return 0;
+
+  pool_class_t* cls = &(stdpool.classes_[idx]);
+  while(cls->free_len_ < num) {
+    if(pool_grow(idx))
+      break;
+  }
+  return cls->free_len_;
+}
+
+void* pool_alloc(size_t size)
+{
+  int idx = pool_get_class(size);
+  pool_chunk_t* c = NULL;
+  if(idx != POOL_NO_CLASS) {
+    pool_class_t* cls = &(stdpool.classes_[idx]);
+    cls->allocs_++;
+    if(cls->free_)
+      cls->hits_++;
+    else
+      pool_grow(idx);
+
+    c = cls->free_;
+    if(c) {
+      cls->free_ = c->next_;
+      cls->free_len_--;
+      c->h_.class_ = idx;
+      c->h_.slab_ = 1;
+      cls->used_++;
+      return c + 1;
+    }
+  }
+
+  c = malloc(sizeof(pool_chunk_t) + size);
+  if(!c)
+    return NULL;
+  c->h_.class_ = idx;
+  c->h_.slab_ = 0;
+  c->h_.size_ = size;
+  if(idx != POOL_NO_CLASS)
+    stdpool.classes_[idx].used_++;
+  else {
+    stdpool.fallback_size_ += size;
+    stdpool.fallback_used_++;
+  }
+  return c + 1;
+}
+
+void pool_free(void* ptr)
+{
+  if(!ptr)
+    return;
+
+  pool_chunk_t* c = (pool_chunk_t*)ptr - 1;
+  int idx = c->h_.class_;
+  if(idx != POOL_NO_CLASS)
+    stdpool.classes_[idx].used_--;
+  else {
+    stdpool.fallback_size_ -= c->h_.size_;
+    stdpool.fallback_used_--;
+  }
+
+  if(!c->h_.slab_) {
+    free(c);
+    return;
+  }
+
+  pool_class_t* cls = &(stdpool.classes_[idx]);
+  c->next_ = cls->free_;
+  cls->free_ = c;
+  cls->free_len_++;
+}
+
+const pool_t* pool_stats()
+{
+  return &stdpool;
+}
+
+void pool_print()
+{
+  log_printf(NOTICE, "pool: %zu of %zu bytes reserved in %d slabs%s", stdpool.size_, stdpool.max_size_,
+             stdpool.num_slabs_, stdpool.hugepages_ == 1 ? " (hugepages)" : (stdpool.hugepages_ ? " (transparent hugepages)" : ""));
+  int i;
+  for(i = 0; i < stdpool.num_classes_; ++i) {
+    pool_class_t* cls = &(stdpool.classes_[i]);
+    log_printf(NOTICE, "pool: %zu byte chunks: %u in use, %u free, %llu allocs, hit rate %.1f%%", cls->size_, cls->used_,
+               cls->free_len_, (unsigned long long)cls->allocs_, cls->allocs_ ? 100.0 * cls->hits_ / cls->allocs_ : 0.0);
+  }
+  if(stdpool.fallback_used_)
+    log_printf(NOTICE, "pool: %u allocations of %zu bytes outside of all size classes", stdpool.fallback_used_, stdpool.fallback_size_);
+}
+
+void pool_clear()
+{
+  int i;
+  for(i = 0; i < stdpool.num_slabs_; ++i)
+    munmap(stdpool.slabs_[i], stdpool.slab_sizes_[i]);
+  if(stdpool.slabs_)
+    free(stdpool.slabs_);
+  if(stdpool.slab_sizes_)
+    free(stdpool.slab_sizes_);
+  pool_init(0, 0);
+}
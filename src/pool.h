@@ -0,0 +1,82 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCPPROXY_pool_h_INCLUDED
+#define TCPPROXY_pool_h_INCLUDED
+
+#include <sys/types.h>
+
+#define POOL_MAX_CLASSES 8
+#define POOL_SLAB_SIZE (64 * 1024)
+#define POOL_HUGEPAGE_SIZE (2 * 1024 * 1024)
+#define POOL_SLAB_CHUNKS 8
+
+union pool_chunk_union {
+  struct {
+    u_int16_t class_;
+    u_int16_t slab_;
+    size_t size_;
+  } h_;
+  union pool_chunk_union* next_;
+  long double align_;
+};
+typedef union pool_chunk_union pool_chunk_t;
+
+struct pool_class_struct {
+  size_t size_;
+  pool_chunk_t* free_;
+  u_int32_t free_len_;
+  u_int32_t used_;
+  u_int64_t allocs_;
+  u_int64_t hits_;
+};
+typedef struct pool_class_struct pool_class_t;
+
+struct pool_struct {
+  size_t max_size_;
+  size_t size_;
+  int hugepages_;
+  pool_class_t classes_[POOL_MAX_CLASSES];
+  int num_classes_;
+  size_t fallback_size_;
+  u_int32_t fallback_used_;
+  void** slabs_;
+  size_t* slab_sizes_;
+  int num_slabs_;
+  int max_slabs_;
+};
+typedef struct pool_struct pool_t;
+
+void pool_init(size_t max_size, int hugepages);
+int pool_prewarm(size_t size, u_int32_t num);
+void* pool_alloc(size_t size);
+void pool_free(void* ptr);
+const pool_t* pool_stats();
+void pool_print();
+void pool_clear();
+
+#endif
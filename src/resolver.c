@@ -0,0 +1,548 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "datatypes.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "resolver.h"
+#include "tcp.h"
+#include "log.h"
+
+static resolver_t stdresolver;
+
+static u_int64_t resolver_clock()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u_int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void resolver_init(u_int32_t ttl)
+{
+  memset(&stdresolver, 0, sizeof(stdresolver));
+  stdresolver.ttl_ = ttl;
+  stdresolver.pipe_ = -1;
+}
+
+static int resolver_convert(struct addrinfo* res, tcp_endpoint_t** addrs)
+{
+  int len = 0;
+  struct addrinfo* r;
+  for(r = res; r; r = r->ai_next)
+    len++;
+
+  *addrs = NULL;
+  if(!len)
+    return 0;
+  *addrs = malloc(len * sizeof(tcp_endpoint_t));
+  if(!(*addrs))
+    return -2;
+
+  int i = 0;
+  for(r = res; r; r = r->ai_next, ++i) {
+    memset(&((*addrs)[i].addr_), 0, sizeof((*addrs)[i].addr_));
+    memcpy(&((*addrs)[i].addr_), r->ai_addr, r->ai_addrlen);
+    (*addrs)[i].len_ = r->ai_addrlen;
+  }
+  return len;
+}
+
+static void resolver_free_job(resolver_job_t* job)
+{
+  if(job->name_)
+    free(job->name_);
+  if(job->service_)
+    free(job->service_);
+  if(job->addrs_)
+    free(job->addrs_);
+  free(job);
+}
+
+static void resolver_free_jobs(resolver_job_t* job)
+{
+  while(job) {
+    resolver_job_t* next = job->next_;
+    job->entry_->pending_ = 0;
+    resolver_free_job(job);
+    job = next;
+  }
+}
+
+static void resolver_free_worker(resolver_worker_t* w)
+{
+  pthread_cond_destroy(&(w->cond_));
+  pthread_mutex_destroy(&(w->mutex_));
+  close(w->pipe_);
+  free(w);
+}
+
+/* drops one of the two references to the worker, must be called with the
+   mutex held, the last user frees the worker */
+static void resolver_put_worker(resolver_worker_t* w)
+{
+  int last = !(--w->users_);
+  pthread_mutex_unlock(&(w->mutex_));
+  if(last)
+    resolver_free_worker(w);
+}
+
+/* the thread only works on the copies of name and service inside the job,
+   this way it may outlive resolver_stop() while getaddrinfo() is blocking */
+static void* resolver_thread(void* arg)
+{
+  resolver_worker_t* w = (resolver_worker_t*)arg;
+
+  pthread_mutex_lock(&(w->mutex_));
+  for(;;) {
+    while(!w->queue_ && !w->stop_)
+      pthread_cond_wait(&(w->cond_), &(w->mutex_));
+    if(w->stop_)
+      break;
+
+    resolver_job_t* job = w->queue_;
+    w->queue_ = job->next_;
+    if(!w->queue_)
+      w->queue_last_ = NULL;
+    w->current_ = job;
+    pthread_mutex_unlock(&(w->mutex_));
+
+    struct addrinfo* res = NULL;
+    job->error_ = tcp_getaddrinfo(job->name_, job->service_, job->rt_, job->flags_, &res);
+    if(!job->error_) {
+      job->len_ = resolver_convert(res, &(job->addrs_));
+      if(job->len_ <= 0)
+        job->error_ = job->len_ ? EAI_MEMORY : EAI_NONAME;
+    }
+    if(res)
+      freeaddrinfo(res);
+
+    pthread_mutex_lock(&(w->mutex_));
+    w->current_ = NULL;
+    if(w->stop_) {
+      resolver_free_job(job);
+      break;
+    }
+    job->next_ = w->done_;
+    w->done_ = job;
+    if(write(w->pipe_, "", 1) < 0 && errno != EAGAIN)
+      w->stop_ = 1;
+  }
+  resolver_put_worker(w);
+  return NULL;
+}
+
+int resolver_start()
+{
+  if(stdresolver.running_)
+    return stdresolver.pipe_;
+
+  resolver_worker_t* w = malloc(sizeof(resolver_worker_t));
+  if(!w) {
+    log_printf(ERROR, "unable to start resolver: memory error");
+    return -1;
+  }
+  memset(w, 0, sizeof(resolver_worker_t));
+
+  int fds[2];
+  if(pipe(fds)) {
+    log_printf(ERROR, "unable to start resolver (pipe error: %s)", strerror(errno));
+    free(w);
+    return -1;
+  }
+  int i;
+  for(i = 0; i < 2; ++i) {
+    int fd_flags = fcntl(fds[i], F_GETFL);
+    if(fd_flags == -1 || fcntl(fds[i], F_SETFL, fd_flags | O_NONBLOCK) == -1 ||
+       fcntl(fds[i], F_SETFD, FD_CLOEXEC) == -1) {
+      log_printf(ERROR, "unable to start resolver (pipe fd[%d] flags error: %s)", i, strerror(errno));
+      close(fds[0]);
+      close(fds[1]);
+      free(w);
+      return -1;
+    }
+  }
+
+  pthread_mutex_init(&(w->mutex_), NULL);
+  pthread_cond_init(&(w->cond_), NULL);
+  w->pipe_ = fds[1];
+  w->users_ = 2;
+
+  /* signals must only be handled by the main thread */
+  sigset_t set, oldset;
+  sigfillset(&set);
+  pthread_sigmask(SIG_SETMASK, &set, &oldset);
+  int ret = pthread_create(&(stdresolver.thread_), NULL, resolver_thread, w);
+  pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+  if(ret) {
+    log_printf(ERROR, "unable to start resolver thread: %s", strerror(ret));
+    resolver_free_worker(w);
+    close(fds[0]);
+    return -1;
+  }
+
+  stdresolver.worker_ = w;
+  stdresolver.pipe_ = fds[0];
+  stdresolver.running_ = 1;
+  return stdresolver.pipe_;
+}
+
+/* waiting for the thread is only safe while it is idle, a lookup which is
+   in progress may block for as long as the system resolver times out. In
+   that case the thread is detached and frees the worker once it returns. */
+void resolver_stop()
+{
+  if(!stdresolver.running_)
+    return;
+
+  resolver_worker_t* w = stdresolver.worker_;
+  pthread_mutex_lock(&(w->mutex_));
+  w->stop_ = 1;
+  pthread_cond_signal(&(w->cond_));
+  resolver_free_jobs(w->queue_);
+  resolver_free_jobs(w->done_);
+  w->queue_ = w->queue_last_ = w->done_ = NULL;
+  int busy = w->current_ != NULL;
+  if(busy) {
+    w->current_->entry_->pending_ = 0;
+    log_printf(NOTICE, "resolver: not waiting for lookup of %s:%s to finish", w->current_->name_,
+               w->current_->service_ ? w->current_->service_ : "0");
+  }
+  resolver_put_worker(w);
+
+  if(busy)
+    pthread_detach(stdresolver.thread_);
+  else
+    pthread_join(stdresolver.thread_, NULL);
+
+  close(stdresolver.pipe_);
+  stdresolver.pipe_ = -1;
+  stdresolver.worker_ = NULL;
+  stdresolver.running_ = 0;
+}
+
+static void resolver_free_entry(resolver_entry_t* e)
+{
+  if(e->name_)
+    free(e->name_);
+  if(e->service_)
+    free(e->service_);
+  if(e->addrs_)
+    free(e->addrs_);
+  free(e);
+}
+
+void resolver_clear()
+{
+  resolver_stop();
+  while(stdresolver.entries_) {
+    resolver_entry_t* e = stdresolver.entries_;
+    stdresolver.entries_ = e->next_;
+    resolver_free_entry(e);
+  }
+}
+
+static int resolver_submit(resolver_entry_t* e)
+{
+  resolver_job_t* job = malloc(sizeof(resolver_job_t));
+  if(!job)
+    return -2;
+
+  memset(job, 0, sizeof(resolver_job_t));
+  job->entry_ = e;
+  job->name_ = e->name_ ? strdup(e->name_) : NULL;
+  job->service_ = e->service_ ? strdup(e->service_) : NULL;
+  job->rt_ = e->rt_;
+  job->flags_ = e->flags_;
+  if((e->name_ && !job->name_) || (e->service_ && !job->service_)) {
+    resolver_free_job(job);
+    return -2;
+  }
+  e->pending_ = 1;
+
+  resolver_worker_t* w = stdresolver.worker_;
+  pthread_mutex_lock(&(w->mutex_));
+  if(w->queue_last_)
+    w->queue_last_->next_ = job;
+  else
+    w->queue_ = job;
+  w->queue_last_ = job;
+  pthread_cond_signal(&(w->cond_));
+  pthread_mutex_unlock(&(w->mutex_));
+
+  log_printf(DEBUG, "resolving %s:%s in the background", e->name_, e->service_ ? e->service_ : "0");
+  return 0;
+}
+
+static u_int64_t resolver_expires(u_int64_t now, int error)
+{
+  if(error)
+    return now + RESOLVER_RETRY_INTERVAL;
+  return stdresolver.ttl_ ? now + (u_int64_t)stdresolver.ttl_ * 1000 : 0;
+}
+
+/* numeric addresses never change and converting them doesn't block, so
+   they are neither refreshed nor handed to the thread */
+static int resolver_resolve_numeric(resolver_entry_t* e)
+{
+  struct addrinfo* res = NULL;
+  if(tcp_getaddrinfo(e->name_, e->service_, e->rt_, e->flags_ | TCP_RESOLVE_NUMERIC, &res)) {
+    if(res)
+      freeaddrinfo(res);
+    return -1;
+  }
+
+  e->len_ = resolver_convert(res, &(e->addrs_));
+  freeaddrinfo(res);
+  if(e->len_ <= 0)
+    return -1;
+
+  e->error_ = 0;
+  e->expires_ = 0;
+  return 0;
+}
+
+static int resolver_resolve(resolver_entry_t* e)
+{
+  struct addrinfo* res = tcp_resolve_endpoint(e->name_, e->service_, e->rt_, e->flags_);
+  if(!res)
+    return -1;
+
+  e->len_ = resolver_convert(res, &(e->addrs_));
+  freeaddrinfo(res);
+  if(e->len_ <= 0)
+    return -1;
+
+  e->error_ = 0;
+  e->expires_ = resolver_expires(resolver_clock(), 0);
+  return 0;
+}
+
+static int resolver_key_equal(const char* a, const char* b)
+{
+  if(!a || !b)
+    return a == b;
+  return !strcmp(a, b);
+}
+
+static void resolver_no_background(const char* name, const char* service)
+{
+  log_printf(ERROR, "%s:%s is neither numeric nor known yet and can't be resolved without blocking, "
+             "new hostnames for listen and source addresses are only resolved at startup", name ? name : "*", service ? service : "0");
+}
+
+resolver_entry_t* resolver_lookup(const char* name, const char* service, resolv_type_t rt, int flags)
+{
+  int no_background = stdresolver.running_ && (flags & RESOLVER_NO_BACKGROUND);
+  flags &= TCP_RESOLVE_PASSIVE;
+  resolver_entry_t* e;
+  for(e = stdresolver.entries_; e; e = e->next_) {
+    if(e->rt_ == rt && e->flags_ == flags && resolver_key_equal(e->name_, name) && resolver_key_equal(e->service_, service))
+      break;
+  }
+
+  if(e) {
+    if(no_background && !e->len_) {
+      resolver_no_background(name, service);
+      return NULL;
+    }
+    e->refcnt_++;
+    if(stdresolver.running_ && !e->pending_ && e->expires_ && e->expires_ <= resolver_clock())
+      resolver_submit(e);
+    return e;
+  }
+
+  e = malloc(sizeof(resolver_entry_t));
+  if(!e)
+    return NULL;
+  memset(e, 0, sizeof(resolver_entry_t));
+  e->name_ = name ? strdup(name) : NULL;
+  e->service_ = service ? strdup(service) : NULL;
+  e->rt_ = rt;
+  e->flags_ = flags;
+  if((name && !e->name_) || (service && !e->service_)) {
+    resolver_free_entry(e);
+    return NULL;
+  }
+
+  /* before the main loop is running it is fine to block, this way errors
+     in the configuration are reported right away */
+  if(resolver_resolve_numeric(e)) {
+    int ret;
+    if(no_background) {
+      resolver_no_background(name, service);
+      ret = -1;
+    } else if(stdresolver.running_)
+      ret = resolver_submit(e);
+    else
+      ret = resolver_resolve(e);
+    if(ret) {
+      resolver_free_entry(e);
+      return NULL;
+    }
+  }
+
+  e->refcnt_ = 1;
+  e->next_ = stdresolver.entries_;
+  stdresolver.entries_ = e;
+  return e;
+}
+
+resolver_entry_t* resolver_ref(resolver_entry_t* e)
+{
+  if(e)
+    e->refcnt_++;
+  return e;
+}
+
+void resolver_release(resolver_entry_t* e)
+{
+  if(e && e->refcnt_ > 0)
+    e->refcnt_--;
+}
+
+int resolver_next_timeout()
+{
+  if(!stdresolver.running_)
+    return -1;
+
+  u_int64_t now = resolver_clock();
+  int timeout = -1;
+  resolver_entry_t* e;
+  for(e = stdresolver.entries_; e; e = e->next_) {
+    if(!e->refcnt_ || e->pending_ || !e->expires_)
+      continue;
+    int t = e->expires_ > now ? (int)(e->expires_ - now) : 0;
+    if(timeout < 0 || t < timeout)
+      timeout = t;
+  }
+  return timeout;
+}
+
+void resolver_refresh()
+{
+  if(!stdresolver.running_)
+    return;
+
+  u_int64_t now = resolver_clock();
+  resolver_entry_t** prev = &(stdresolver.entries_);
+  while(*prev) {
+    resolver_entry_t* e = *prev;
+    if(!e->refcnt_ && !e->pending_) {
+      log_printf(DEBUG, "removing unused cache entry for %s:%s", e->name_, e->service_ ? e->service_ : "0");
+      *prev = e->next_;
+      resolver_free_entry(e);
+      continue;
+    }
+    if(e->pending_ || !e->expires_ || e->expires_ > now) {
+      prev = &(e->next_);
+      continue;
+    }
+    resolver_submit(e);
+    prev = &(e->next_);
+  }
+}
+
+static int resolver_changed(resolver_entry_t* e, resolver_job_t* job)
+{
+  if(e->len_ != job->len_)
+    return 1;
+
+  int i;
+  for(i = 0; i < job->len_; ++i) {
+    if(e->addrs_[i].len_ != job->addrs_[i].len_ || memcmp(&(e->addrs_[i].addr_), &(job->addrs_[i].addr_), job->addrs_[i].len_))
+      return 1;
+  }
+  return 0;
+}
+
+void resolver_handle_results(void (*updated)(resolver_entry_t*))
+{
+  if(!stdresolver.running_)
+    return;
+
+  char buf[64];
+  while(read(stdresolver.pipe_, buf, sizeof(buf)) > 0);
+
+  resolver_worker_t* w = stdresolver.worker_;
+  pthread_mutex_lock(&(w->mutex_));
+  resolver_job_t* job = w->done_;
+  w->done_ = NULL;
+  pthread_mutex_unlock(&(w->mutex_));
+
+  u_int64_t now = resolver_clock();
+  while(job) {
+    resolver_job_t* next = job->next_;
+    resolver_entry_t* e = job->entry_;
+    e->pending_ = 0;
+    e->expires_ = resolver_expires(now, job->error_);
+    if(job->error_) {
+      e->error_ = job->error_;
+      log_printf(WARNING, "unable to resolve %s:%s: %s, keeping %d cached address(es)", e->name_, e->service_ ? e->service_ : "0",
+                 gai_strerror(job->error_), e->len_);
+    } else {
+      e->error_ = 0;
+      if(resolver_changed(e, job)) {
+        log_printf(INFO, "%s:%s now resolves to %d address(es)", e->name_, e->service_ ? e->service_ : "0", job->len_);
+        if(e->addrs_)
+          free(e->addrs_);
+        e->addrs_ = job->addrs_;
+        e->len_ = job->len_;
+        job->addrs_ = NULL;
+        if(updated)
+          updated(e);
+      }
+    }
+    resolver_free_job(job);
+    job = next;
+  }
+}
+
+void resolver_print()
+{
+  u_int64_t now = resolver_clock();
+  resolver_entry_t* e;
+  for(e = stdresolver.entries_; e; e = e->next_) {
+    char expires[32] = "never";
+    if(e->pending_)
+      strcpy(expires, "now");
+    else if(e->expires_)
+      snprintf(expires, sizeof(expires), "in %llus", e->expires_ > now ? (unsigned long long)(e->expires_ - now + 999) / 1000 : 0ULL);
+    log_printf(NOTICE, "resolver: %s:%s -> %d address(es)%s%s, %d user(s), refresh %s", e->name_, e->service_ ? e->service_ : "0", e->len_,
+               e->error_ ? ", last error: " : "", e->error_ ? gai_strerror(e->error_) : "", e->refcnt_, expires);
+  }
+}
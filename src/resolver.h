@@ -0,0 +1,106 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCPPROXY_resolver_h_INCLUDED
+#define TCPPROXY_resolver_h_INCLUDED
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "tcp.h"
+
+#define RESOLVER_DEFAULT_TTL 60
+#define RESOLVER_RETRY_INTERVAL 5000
+
+/* in addition to TCP_RESOLVE_PASSIVE, names which are neither numeric nor
+   cached fail instead of being resolved in the background */
+#define RESOLVER_NO_BACKGROUND 4
+
+struct resolver_entry_struct {
+  char* name_;
+  char* service_;
+  resolv_type_t rt_;
+  int flags_;
+  tcp_endpoint_t* addrs_;
+  int len_;
+  int error_;
+  int pending_;
+  u_int64_t expires_;
+  int refcnt_;
+  struct resolver_entry_struct* next_;
+};
+typedef struct resolver_entry_struct resolver_entry_t;
+
+struct resolver_job_struct {
+  resolver_entry_t* entry_;
+  char* name_;
+  char* service_;
+  resolv_type_t rt_;
+  int flags_;
+  tcp_endpoint_t* addrs_;
+  int len_;
+  int error_;
+  struct resolver_job_struct* next_;
+};
+typedef struct resolver_job_struct resolver_job_t;
+
+struct resolver_worker_struct {
+  pthread_mutex_t mutex_;
+  pthread_cond_t cond_;
+  int stop_;
+  int users_;
+  resolver_job_t* current_;
+  resolver_job_t* queue_;
+  resolver_job_t* queue_last_;
+  resolver_job_t* done_;
+  int pipe_;
+};
+typedef struct resolver_worker_struct resolver_worker_t;
+
+struct resolver_struct {
+  u_int32_t ttl_;
+  resolver_entry_t* entries_;
+  int running_;
+  pthread_t thread_;
+  resolver_worker_t* worker_;
+  int pipe_;
+};
+typedef struct resolver_struct resolver_t;
+
+void resolver_init(u_int32_t ttl);
+int resolver_start();
+void resolver_stop();
+void resolver_clear();
+resolver_entry_t* resolver_lookup(const char* name, const char* service, resolv_type_t rt, int flags);
+resolver_entry_t* resolver_ref(resolver_entry_t* e);
+void resolver_release(resolver_entry_t* e);
+int resolver_next_timeout();
+void resolver_refresh();
+void resolver_handle_results(void (*updated)(resolver_entry_t*));
+void resolver_print();
+
+#endif
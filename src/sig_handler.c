@@ -94,6 +94,20 @@ int signal_init()
   return sig_pipe_fds[0];
 }
 
+int signal_handle_children()
+{
+  struct sigaction act;
+  act.sa_handler = sig_handler;
+  sigfillset(&act.sa_mask);
+  act.sa_flags = SA_NOCLDSTOP;
+
+  if(sigaction(SIGCHLD, &act, NULL) < 0) {
+    log_printf(ERROR, "signal handling init failed (sigaction error: %s)", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
 int signal_handle()
 {
   sigset_t set, oldset, tmpset;
@@ -105,6 +119,7 @@ int signal_handle()
   sigaddset(&tmpset, SIGHUP);
   sigaddset(&tmpset, SIGUSR1);
   sigaddset(&tmpset, SIGUSR2);
+  sigaddset(&tmpset, SIGCHLD);
   sigprocmask(SIG_BLOCK, &tmpset, &oldset);
 
   int ret = read(sig_pipe_fds[0], &set, sizeof(sigset_t));
@@ -122,6 +137,7 @@ int signal_handle()
       case SIGHUP: log_printf(NOTICE, "SIG-Hup caught"); return_value = SIGHUP; break;
       case SIGUSR1: log_printf(NOTICE, "SIG-Usr1 caught"); return_value = SIGUSR1; break;
       case SIGUSR2: log_printf(NOTICE, "SIG-Usr2 caught"); return_value = SIGUSR2; break;
+      case SIGCHLD: log_printf(DEBUG, "SIG-Chld caught"); if(!return_value) return_value = SIGCHLD; break;
       default: log_printf(WARNING, "unknown signal %d caught, ignoring", sig); break;
       }
       sigdelset(&set, sig);
@@ -145,6 +161,7 @@ void signal_stop()
   sigaction(SIGHUP, &act, NULL);
   sigaction(SIGUSR1, &act, NULL);
   sigaction(SIGUSR2, &act, NULL);
+  sigaction(SIGCHLD, &act, NULL);
   sigaction(SIGPIPE, &act, NULL);
 
   close(sig_pipe_fds[0]);
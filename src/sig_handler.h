@@ -29,6 +29,7 @@
 #define TCPPROXY_sig_handler_h_INCLUDED
 
 int signal_init();
+int signal_handle_children();
 int signal_handle();
 void signal_stop();
 
@@ -32,7 +32,10 @@
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
+#include <errno.h>
 
 #include "datatypes.h"
 
@@ -59,15 +62,17 @@ char* tcp_endpoint_to_string(tcp_endpoint_t e)
   return ret;
 }
 
-struct addrinfo* tcp_resolve_endpoint(const char* addr, const char* port, resolv_type_t rt, int passive)
+int tcp_getaddrinfo(const char* addr, const char* port, resolv_type_t rt, int flags, struct addrinfo** res)
 {
-  struct addrinfo hints, *res;
+  struct addrinfo hints;
 
-  res = NULL;
+  *res = NULL;
   memset (&hints, 0, sizeof (hints));
   hints.ai_socktype = SOCK_STREAM;
-  if(passive)
+  if(flags & TCP_RESOLVE_PASSIVE)
     hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG;
+  if(flags & TCP_RESOLVE_NUMERIC)
+    hints.ai_flags |= AI_NUMERICHOST;
 
   switch(rt) {
   case IPV4_ONLY: hints.ai_family = AF_INET; break;
@@ -75,7 +80,14 @@ struct addrinfo* tcp_resolve_endpoint(const char* addr, const char* port, resolv
   default: hints.ai_family = AF_UNSPEC; break;
   }
 
-  int errcode = getaddrinfo(addr, port, &hints, &res);
+  return getaddrinfo(addr, port, &hints, res);
+}
+
+struct addrinfo* tcp_resolve_endpoint(const char* addr, const char* port, resolv_type_t rt, int flags)
+{
+  struct addrinfo* res;
+
+  int errcode = tcp_getaddrinfo(addr, port, rt, flags, &res);
   if (errcode != 0) {
     char* type = "";
     if(rt == IPV4_ONLY) type = "IPv4 ";
@@ -90,3 +102,112 @@ struct addrinfo* tcp_resolve_endpoint(const char* addr, const char* port, resolv
 
   return res;
 }
+
+void tcp_sockopts_init(tcp_sockopts_t* opts)
+{
+  opts->nodelay_ = 1;
+  opts->rcvbuf_ = -1;
+  opts->sndbuf_ = -1;
+  opts->notsent_lowat_ = -1;
+  opts->keepidle_ = -1;
+  opts->keepintvl_ = -1;
+  opts->keepcnt_ = -1;
+  opts->user_timeout_ = -1;
+  opts->priority_ = -1;
+  opts->tos_ = -1;
+  opts->congestion_[0] = 0;
+  opts->fastopen_ = -1;
+  opts->defer_accept_ = -1;
+}
+
+static int tcp_setsockopt_int(int fd, int level, int name, const char* str, int value)
+{
+  if(value < 0)
+    return 0;
+
+  if(setsockopt(fd, level, name, &value, sizeof(value)))
+    log_printf(INFO, "Error on setsockopt(%s) for %d: %s", str, fd, strerror(errno));
+  return 1;
+}
+
+/* the buffer sizes need to be set before the connection is established to
+   take effect on the window scaling. Accepted connections inherit all of
+   these from the listening socket so they are only set there, saving the
+   calls for every client, TCP_SOCKOPTS_LISTEN adds the options only
+   meaningful on listening sockets. Failures are logged and otherwise
+   ignored, the number of setsockopt() calls made is returned */
+int tcp_set_sockopts(int fd, int family, const tcp_sockopts_t* opts, int which)
+{
+  if(!opts)
+    return 0;
+
+  int ret = 0;
+  if(which & TCP_SOCKOPTS_BUFFERS) {
+    ret += tcp_setsockopt_int(fd, SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF", opts->rcvbuf_);
+    ret += tcp_setsockopt_int(fd, SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF", opts->sndbuf_);
+  }
+  if(which & TCP_SOCKOPTS_LISTEN) {
+#ifdef TCP_FASTOPEN
+    ret += tcp_setsockopt_int(fd, IPPROTO_TCP, TCP_FASTOPEN, "TCP_FASTOPEN", opts->fastopen_);
+#endif
+#ifdef TCP_DEFER_ACCEPT
+    ret += tcp_setsockopt_int(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, "TCP_DEFER_ACCEPT", opts->defer_accept_);
+#endif
+  }
+#ifdef TCP_FASTOPEN_CONNECT
+  if((which & TCP_SOCKOPTS_FASTOPEN) && opts->fastopen_ > 0)
+    ret += tcp_setsockopt_int(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, "TCP_FASTOPEN_CONNECT", 1);
+#endif
+  if(!(which & TCP_SOCKOPTS_CONNECTION))
+    return ret;
+
+  ret += tcp_setsockopt_int(fd, IPPROTO_TCP, TCP_NODELAY, "TCP_NODELAY", opts->nodelay_);
+#ifdef TCP_NOTSENT_LOWAT
+  ret += tcp_setsockopt_int(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, "TCP_NOTSENT_LOWAT", opts->notsent_lowat_);
+#endif
+  if(opts->keepidle_ >= 0) {
+    ret += tcp_setsockopt_int(fd, SOL_SOCKET, SO_KEEPALIVE, "SO_KEEPALIVE", 1);
+#ifdef TCP_KEEPIDLE
+    ret += tcp_setsockopt_int(fd, IPPROTO_TCP, TCP_KEEPIDLE, "TCP_KEEPIDLE", opts->keepidle_);
+    ret += tcp_setsockopt_int(fd, IPPROTO_TCP, TCP_KEEPINTVL, "TCP_KEEPINTVL", opts->keepintvl_);
+    ret += tcp_setsockopt_int(fd, IPPROTO_TCP, TCP_KEEPCNT, "TCP_KEEPCNT", opts->keepcnt_);
+#endif
+  }
+#ifdef TCP_USER_TIMEOUT
+  ret += tcp_setsockopt_int(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, "TCP_USER_TIMEOUT", opts->user_timeout_ >= 0 ? opts->user_timeout_ * 1000 : -1);
+#endif
+#ifdef SO_PRIORITY
+  ret += tcp_setsockopt_int(fd, SOL_SOCKET, SO_PRIORITY, "SO_PRIORITY", opts->priority_);
+#endif
+  if(family == AF_INET6)
+    ret += tcp_setsockopt_int(fd, IPPROTO_IPV6, IPV6_TCLASS, "IPV6_TCLASS", opts->tos_);
+  else
+    ret += tcp_setsockopt_int(fd, IPPROTO_IP, IP_TOS, "IP_TOS", opts->tos_);
+#ifdef TCP_CONGESTION
+  if(opts->congestion_[0]) {
+    if(setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, opts->congestion_, strlen(opts->congestion_)))
+      log_printf(INFO, "Error on setsockopt(TCP_CONGESTION) for %d: %s", fd, strerror(errno));
+    ret++;
+  }
+#endif
+
+  return ret;
+}
+
+/* binds fd to the source address leaving the port to be picked at connect()
+   time, this way the 4-tuple only has to be unique rather than the port which
+   keeps busy sources from running out of ports. Returns the number of system
+   calls made or -1 if bind() failed */
+int tcp_bind_source(int fd, const tcp_endpoint_t* source)
+{
+  int ret = 1;
+#ifdef IP_BIND_ADDRESS_NO_PORT
+  int on = 1;
+  if(setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof(on)))
+    log_printf(DEBUG, "Error on setsockopt(IP_BIND_ADDRESS_NO_PORT) for %d: %s", fd, strerror(errno));
+  ret++;
+#endif
+  if(bind(fd, (struct sockaddr *)&(source->addr_), source->len_))
+    return -1;
+  return ret;
+}
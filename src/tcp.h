@@ -39,7 +39,35 @@ typedef struct {
   struct sockaddr_storage addr_;
 } tcp_endpoint_t;
 
+#define TCP_SOCKOPTS_BUFFERS 1
+#define TCP_SOCKOPTS_CONNECTION 2
+#define TCP_SOCKOPTS_LISTEN 4
+#define TCP_SOCKOPTS_FASTOPEN 8
+
+#define TCP_RESOLVE_PASSIVE 1
+#define TCP_RESOLVE_NUMERIC 2
+
+typedef struct {
+  int nodelay_;
+  int rcvbuf_;
+  int sndbuf_;
+  int notsent_lowat_;
+  int keepidle_;
+  int keepintvl_;
+  int keepcnt_;
+  int user_timeout_;
+  int priority_;
+  int tos_;
+  char congestion_[16];
+  int fastopen_;
+  int defer_accept_;
+} tcp_sockopts_t;
+
 char* tcp_endpoint_to_string(tcp_endpoint_t e);
-struct addrinfo* tcp_resolve_endpoint(const char* addr, const char* port, resolv_type_t rt, int passive);
+struct addrinfo* tcp_resolve_endpoint(const char* addr, const char* port, resolv_type_t rt, int flags);
+int tcp_getaddrinfo(const char* addr, const char* port, resolv_type_t rt, int flags, struct addrinfo** res);
+void tcp_sockopts_init(tcp_sockopts_t* opts);
+int tcp_set_sockopts(int fd, int family, const tcp_sockopts_t* opts, int which);
+int tcp_bind_source(int fd, const tcp_endpoint_t* source);
 
 #endif
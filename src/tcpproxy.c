@@ -29,10 +29,11 @@
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
-#include <sys/select.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <signal.h>
+#include <sys/select.h>
+#include <sys/wait.h>
 
 #include "datatypes.h"
 #include "options.h"
@@ -41,11 +42,25 @@
 #include "log.h"
 #include "daemon.h"
 
+#include "poller.h"
+#include "pool.h"
+#include "resolver.h"
+#include "backend.h"
 #include "listener.h"
 #include "clients.h"
+#include "admin.h"
 #include "cfg_parser.h"
 
-int main_loop(options_t* opt, listeners_t* listeners)
+static int next_timeout(int a, int b)
+{
+  if(a < 0)
+    return b;
+  if(b < 0)
+    return a;
+  return a < b ? a : b;
+}
+
+int main_loop(options_t* opt, listeners_t* listeners, int worker)
 {
   log_printf(INFO, "entering main loop");
 
@@ -53,28 +68,61 @@ int main_loop(options_t* opt, listeners_t* listeners)
   if(sig_fd < 0)
     return -1;
 
+  poller_t poller;
+  int return_value = poller_init(&poller, opt->event_backend_);
+  if(return_value) {
+    signal_stop();
+    return -1;
+  }
+
+  pool_init((size_t)opt->pool_size_ * 1024 * 1024, opt->hugepages_);
+  if(opt->pool_prewarm_) {
+    pool_prewarm(sizeof(client_t), opt->pool_prewarm_);
+    pool_prewarm(opt->buffer_size_, 2 * opt->pool_prewarm_);
+  }
+
   clients_t clients;
-  int return_value = clients_init(&clients, opt->buffer_size_);
+  return_value = clients_init(&clients, opt->buffer_size_, &poller);
+  if(!return_value)
+    return_value = poller_set(&poller, sig_fd, POLLER_READ);
+  int resolver_fd = -1;
+  if(!return_value) {
+    resolver_fd = resolver_start();
+    if(resolver_fd < 0)
+      log_printf(WARNING, "no background resolver, remote hostnames will not be re-resolved");
+    else
+      return_value = poller_set(&poller, resolver_fd, POLLER_READ);
+  }
+  if(!return_value) {
+    listeners_set_poller(listeners, &poller);
+    backends_set_poller(&poller);
+  }
+  admin_t admin;
+  if(admin_init(&admin, return_value ? NULL : opt->admin_, worker, &poller))
+    return_value = -1;
 
+  u_int64_t loops = 0;
   while(!return_value) {
-    fd_set readfds, writefds;
-    FD_ZERO(&readfds);
-    FD_ZERO(&writefds);
-    FD_SET(sig_fd, &readfds);
-    int nfds = sig_fd;
-    listeners_read_fds(listeners, &readfds, &nfds);
-    clients_read_fds(&clients, &readfds, &nfds);
-    clients_write_fds(&clients, &writefds, &nfds);
-    int ret = select(nfds + 1, &readfds, &writefds, NULL, NULL);
+    loops++;
+    int timeout = next_timeout(clients_next_timeout(&clients), resolver_next_timeout());
+    timeout = next_timeout(timeout, listeners_next_timeout(listeners));
+    int ret = poller_wait(&poller, next_timeout(timeout, backends_next_timeout()));
     if(ret == -1 && errno != EINTR) {
-      log_printf(ERROR, "select returned with error: %s", strerror(errno));
+      log_printf(ERROR, "%s returned with error: %s", poller_backend_to_string(poller.backend_), strerror(errno));
       return_value = -1;
       break;
     }
-    if(!ret || ret == -1)
+    clients_handle_timeouts(&clients);
+    backends_handle_timeouts();
+    listeners_handle_timeouts(listeners);
+    resolver_refresh();
+    if(ret == -1)
       continue;
 
-    if(FD_ISSET(sig_fd, &readfds)) {
+    if(resolver_fd >= 0 && (poller_ready(&poller, resolver_fd) & POLLER_READ))
+      resolver_handle_results(backends_resolved);
+
+    if(poller_ready(&poller, sig_fd) & POLLER_READ) {
       return_value = signal_handle();
       if(return_value == SIGINT || return_value == SIGQUIT || return_value == SIGTERM) break;
       if(return_value == SIGHUP) {
@@ -89,23 +137,198 @@ int main_loop(options_t* opt, listeners_t* listeners)
         listeners_print(listeners);
       } else if(return_value == SIGUSR2) {
         clients_print(&clients);
+        pool_print();
+        resolver_print();
       }
     }
 
-    return_value = listeners_handle_accept(listeners, &clients, &readfds);
-    if(return_value) break;
-
-    return_value = clients_write(&clients, &writefds);
+    return_value = clients_handle_ready(&clients);
     if(return_value) break;
+    backends_handle_ready();
 
-    return_value = clients_read(&clients, &readfds);
+    return_value = listeners_handle_accept(listeners, &clients);
+    admin_handle_ready(&admin, listeners, &clients, loops);
   }
 
+  admin_clear(&admin);
   clients_clear(&clients);
+  pool_clear();
+  listeners_set_poller(listeners, NULL);
+  backends_set_poller(NULL);
+  if(resolver_fd >= 0)
+    poller_set(&poller, resolver_fd, 0);
+  resolver_stop();
+  poller_clear(&poller);
+  signal_stop();
+  return return_value;
+}
+
+static int init_listeners(options_t* opt, listeners_t* listeners)
+{
+  int ret = listeners_init(listeners);
+  if(ret)
+    return ret;
+
+  listeners->reuse_port_ = (opt->workers_ > 1);
+  listeners->accept_budget_ = opt->accept_budget_;
+  listeners->max_clients_ = opt->max_clients_;
+  if(opt->local_port_) {
+    client_timeouts_t timeouts;
+    timeouts.connect_ = opt->connect_timeout_ * 1000;
+    timeouts.idle_ = opt->idle_timeout_ * 1000;
+    timeouts.linger_ = opt->linger_timeout_ * 1000;
+    backend_health_t health;
+    health.max_fails_ = opt->max_fails_;
+    health.fail_timeout_ = opt->fail_timeout_ * 1000;
+    health.interval_ = opt->health_check_ * 1000;
+    health.slow_start_ = opt->slow_start_ * 1000;
+    backends_t* backends = backends_new(opt->balance_);
+    if(!backends)
+      ret = -2;
+    else {
+      backends_set_health(backends, health);
+      backends->retries_ = opt->connect_retries_;
+      backends_set_preconnect(backends, opt->preconnect_);
+      backends->defer_connect_ = opt->defer_connect_;
+      ret = backends_add(backends, opt->remote_addr_, opt->remote_port_, opt->rresolv_type_, 1);
+    }
+    if(!ret && opt->source_addr_)
+      ret = backends_set_source(backends, opt->source_addr_, opt->rresolv_type_);
+    if(!ret)
+      ret = listeners_add(listeners, opt->local_addr_, opt->lresolv_type_, opt->local_port_, backends, opt->relay_, opt->backlog_, timeouts, NULL);
+    backends_unref(backends);
+    if(!ret) ret = listeners_update(listeners);
+  } else {
+    ret = read_configfile(opt->config_file_, listeners);
+    if(!ret && !slist_length(&(listeners->list_))) {
+      log_printf(ERROR, "no listeners defined in config file %s", opt->config_file_);
+      ret = -1;
+    }
+  }
+  if(ret)
+    listeners_clear(listeners);
+
+  return ret;
+}
+
+static void clear_listeners(listeners_t* listeners, int num)
+{
+  int i;
+  for(i = 0; i < num; ++i)
+    listeners_clear(&(listeners[i]));
+  free(listeners);
+}
+
+static int reap_workers(pid_t* workers, int num)
+{
+  int cnt = 0;
+  pid_t pid;
+  int status;
+  while((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    int i;
+    for(i = 0; i < num; ++i) {
+      if(workers[i] != pid)
+        continue;
+      if(WIFSIGNALED(status))
+        log_printf(WARNING, "worker %d (pid %d) was terminated by signal %d", i, pid, WTERMSIG(status));
+      else
+        log_printf(WARNING, "worker %d (pid %d) exited with status %d", i, pid, WEXITSTATUS(status));
+      workers[i] = -1;
+      cnt++;
+    }
+  }
+  return cnt;
+}
+
+static int master_loop(pid_t* workers, int num)
+{
+  int sig_fd = signal_init();
+  if(sig_fd < 0)
+    return -1;
+  signal_handle_children();
+
+  int alive = num - reap_workers(workers, num);
+  int return_value = 0;
+  while(alive) {
+    fd_set readfds;
+    FD_ZERO(&readfds);
+    FD_SET(sig_fd, &readfds);
+    int ret = select(sig_fd + 1, &readfds, NULL, NULL, NULL);
+    if(ret == -1 && errno != EINTR) {
+      log_printf(ERROR, "select returned with error: %s", strerror(errno));
+      return_value = -1;
+      break;
+    }
+    if(ret <= 0)
+      continue;
+
+    int sig = signal_handle();
+    alive -= reap_workers(workers, num);
+    if(!sig || sig == SIGCHLD)
+      continue;
+
+    int i;
+    for(i = 0; i < num; ++i)
+      if(workers[i] > 0)
+        kill(workers[i], sig);
+
+    if(sig == SIGINT || sig == SIGQUIT || sig == SIGTERM) {
+      return_value = sig;
+      break;
+    }
+  }
+  if(!alive) {
+    log_printf(ERROR, "all workers are gone, exitting");
+    return_value = -1;
+  }
+
+  while(alive && waitpid(-1, NULL, 0) > 0)
+    alive--;
+
   signal_stop();
   return return_value;
 }
 
+int run_workers(options_t* opt, listeners_t* listeners)
+{
+  pid_t* workers = malloc(opt->workers_ * sizeof(pid_t));
+  if(!workers)
+    return -2;
+
+  int i;
+  for(i = 0; i < opt->workers_; ++i) {
+    workers[i] = fork();
+    if(workers[i] < 0) {
+      log_printf(ERROR, "fork() for worker %d failed: %s", i, strerror(errno));
+      int j;
+      for(j = 0; j < i; ++j)
+        kill(workers[j], SIGTERM);
+      for(j = 0; j < i; ++j)
+        waitpid(workers[j], NULL, 0);
+      free(workers);
+      return -1;
+    }
+    if(!workers[i]) {
+      free(workers);
+      int j;
+      for(j = 0; j < opt->workers_; ++j)
+        if(j != i)
+          listeners_clear(&(listeners[j]));
+
+      log_printf(NOTICE, "worker %d started (pid %d)", i, getpid());
+      return main_loop(opt, &(listeners[i]), i);
+    }
+  }
+
+  for(i = 0; i < opt->workers_; ++i)
+    listeners_clear(&(listeners[i]));
+
+  log_printf(NOTICE, "started %d workers", opt->workers_);
+  int ret = master_loop(workers, opt->workers_);
+  free(workers);
+  return ret;
+}
+
 int main(int argc, char* argv[])
 {
   log_init();
@@ -153,30 +376,19 @@ int main(int argc, char* argv[])
 
   log_printf(NOTICE, "just started...");
   options_parse_post(&opt);
+  resolver_init(opt.dns_ttl_);
 
-  listeners_t listeners;
-  ret = listeners_init(&listeners);
-  if(ret) {
+  listeners_t* listeners = malloc(opt.workers_ * sizeof(listeners_t));
+  if(!listeners) {
     options_clear(&opt);
     log_close();
     exit(-1);
   }
-
-  if(opt.local_port_) {
-    ret = listeners_add(&listeners, opt.local_addr_, opt.lresolv_type_, opt.local_port_, opt.remote_addr_, opt.rresolv_type_, opt.remote_port_, opt.source_addr_);
-    if(!ret) ret = listeners_update(&listeners);
+  int i;
+  for(i = 0; i < opt.workers_; ++i) {
+    ret = init_listeners(&opt, &(listeners[i]));
     if(ret) {
-      listeners_clear(&listeners);
-      options_clear(&opt);
-      log_close();
-      exit(-1);
-    }
-  } else {
-    ret = read_configfile(opt.config_file_, &listeners);
-    if(ret || !slist_length(&listeners)) {
-      if(!ret)
-        log_printf(ERROR, "no listeners defined in config file %s", opt.config_file_);
-      listeners_clear(&listeners);
+      clear_listeners(listeners, i);
       options_clear(&opt);
       log_close();
       exit(-1);
@@ -186,7 +398,7 @@ int main(int argc, char* argv[])
   priv_info_t priv;
   if(opt.username_)
     if(priv_init(&priv, opt.username_, opt.groupname_)) {
-      listeners_clear(&listeners);
+      clear_listeners(listeners, opt.workers_);
       options_clear(&opt);
       log_close();
       exit(-1);
@@ -202,14 +414,14 @@ int main(int argc, char* argv[])
 
   if(opt.chroot_dir_)
     if(do_chroot(opt.chroot_dir_)) {
-      listeners_clear(&listeners);
+      clear_listeners(listeners, opt.workers_);
       options_clear(&opt);
       log_close();
       exit(-1);
     }
   if(opt.username_)
     if(priv_drop(&priv)) {
-      listeners_clear(&listeners);
+      clear_listeners(listeners, opt.workers_);
       options_clear(&opt);
       log_close();
       exit(-1);
@@ -227,9 +439,13 @@ int main(int argc, char* argv[])
     fclose(pid_file);
   }
 
-  ret = main_loop(&opt, &listeners);
+  if(opt.workers_ > 1)
+    ret = run_workers(&opt, listeners);
+  else
+    ret = main_loop(&opt, &(listeners[0]), -1);
 
-  listeners_clear(&listeners);
+  clear_listeners(listeners, opt.workers_);
+  resolver_clear();
   options_clear(&opt);
 
   if(!ret)
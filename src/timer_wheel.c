@@ -0,0 +1,198 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "datatypes.h"
+
+#include <string.h>
+#include <time.h>
+
+#include "timer_wheel.h"
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_RANGE ((u_int64_t)1 << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS))
+
+static u_int64_t timer_wheel_clock()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u_int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void timer_entry_init(timer_entry_t* t, void* data)
+{
+  t->prev_ = NULL;
+  t->next_ = NULL;
+  t->expires_ = 0;
+  t->slot_ = -1;
+  t->data_ = data;
+}
+
+void timer_wheel_init(timer_wheel_t* w)
+{
+  memset(w, 0, sizeof(timer_wheel_t));
+  w->now_ = timer_wheel_clock();
+  w->tick_ = w->now_ / TIMER_WHEEL_TICK_MS;
+}
+
+u_int64_t timer_wheel_now(timer_wheel_t* w)
+{
+  return w->now_;
+}
+
+static void timer_wheel_link(timer_wheel_t* w, timer_entry_t* t)
+{
+  if(t->expires_ < w->tick_)
+    t->expires_ = w->tick_;
+  if(t->expires_ - w->tick_ >= TIMER_WHEEL_RANGE)
+    t->expires_ = w->tick_ + TIMER_WHEEL_RANGE - 1;
+
+  u_int64_t delta = t->expires_ - w->tick_;
+  int level = 0;
+  while(level < TIMER_WHEEL_LEVELS - 1 && delta >= ((u_int64_t)1 << ((level + 1) * TIMER_WHEEL_BITS)))
+    level++;
+
+  int slot = level * TIMER_WHEEL_SLOTS + ((t->expires_ >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK);
+  t->slot_ = slot;
+  t->prev_ = NULL;
+  t->next_ = w->slots_[slot];
+  if(t->next_)
+    t->next_->prev_ = t;
+  w->slots_[slot] = t;
+  if(!level)
+    w->pending_[slot >> 6] |= (u_int64_t)1 << (slot & 63);
+}
+
+static void timer_wheel_unlink(timer_wheel_t* w, timer_entry_t* t)
+{
+  if(t->prev_)
+    t->prev_->next_ = t->next_;
+  else
+    w->slots_[t->slot_] = t->next_;
+  if(t->next_)
+    t->next_->prev_ = t->prev_;
+
+  if(t->slot_ < TIMER_WHEEL_SLOTS && !w->slots_[t->slot_])
+    w->pending_[t->slot_ >> 6] &= ~((u_int64_t)1 << (t->slot_ & 63));
+  t->prev_ = NULL;
+  t->next_ = NULL;
+  t->slot_ = -1;
+}
+
+void timer_wheel_set(timer_wheel_t* w, timer_entry_t* t, u_int64_t expires)
+{
+  if(t->slot_ >= 0)
+    timer_wheel_unlink(w, t);
+  else
+    w->count_++;
+
+  t->expires_ = (expires + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+  if(t->expires_ <= w->tick_)
+    t->expires_ = w->tick_ + 1;
+  timer_wheel_link(w, t);
+}
+
+void timer_wheel_cancel(timer_wheel_t* w, timer_entry_t* t)
+{
+  if(t->slot_ < 0)
+    return;
+
+  timer_wheel_unlink(w, t);
+  w->count_--;
+}
+
+int timer_wheel_next(timer_wheel_t* w)
+{
+  if(!w->count_)
+    return -1;
+
+  /* the next cascade happens when the lowest level wraps around */
+  u_int64_t tick = (w->tick_ | TIMER_WHEEL_MASK) + 1;
+  int start = (w->tick_ + 1) & TIMER_WHEEL_MASK;
+  int i;
+  for(i = 0; i < TIMER_WHEEL_SLOTS; ++i) {
+    int idx = (start + i) & TIMER_WHEEL_MASK;
+    if(!(idx & 63) && !w->pending_[idx >> 6] && i + 64 <= TIMER_WHEEL_SLOTS) {
+      i += 63;
+      continue;
+    }
+    if(w->pending_[idx >> 6] & ((u_int64_t)1 << (idx & 63))) {
+      if(w->tick_ + 1 + i < tick)
+        tick = w->tick_ + 1 + i;
+      break;
+    }
+  }
+
+  u_int64_t now = timer_wheel_clock();
+  if(tick * TIMER_WHEEL_TICK_MS <= now)
+    return 0;
+  return (int)(tick * TIMER_WHEEL_TICK_MS - now);
+}
+
+static void timer_wheel_cascade(timer_wheel_t* w, int level)
+{
+  int slot = level * TIMER_WHEEL_SLOTS + ((w->tick_ >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK);
+  timer_entry_t* t = w->slots_[slot];
+  w->slots_[slot] = NULL;
+  while(t) {
+    timer_entry_t* next = t->next_;
+    timer_wheel_link(w, t);
+    t = next;
+  }
+}
+
+void timer_wheel_advance(timer_wheel_t* w, void (*expired)(timer_entry_t*, void*), void* ctx)
+{
+  w->now_ = timer_wheel_clock();
+  u_int64_t target = w->now_ / TIMER_WHEEL_TICK_MS;
+
+  while(w->tick_ < target) {
+    if(!w->count_) {
+      w->tick_ = target;
+      break;
+    }
+    w->tick_++;
+
+    int level;
+    for(level = 1; level < TIMER_WHEEL_LEVELS; ++level)
+      if(w->tick_ & (((u_int64_t)1 << (level * TIMER_WHEEL_BITS)) - 1))
+        break;
+    for(level = level - 1; level > 0; --level)
+      timer_wheel_cascade(w, level);
+
+    int slot = w->tick_ & TIMER_WHEEL_MASK;
+    while(w->slots_[slot]) {
+      timer_entry_t* t = w->slots_[slot];
+      timer_wheel_unlink(w, t);
+      if(t->expires_ > w->tick_) {
+        timer_wheel_link(w, t);
+        continue;
+      }
+      w->count_--;
+      expired(t, ctx);
+    }
+  }
+}
@@ -0,0 +1,65 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCPPROXY_timer_wheel_h_INCLUDED
+#define TCPPROXY_timer_wheel_h_INCLUDED
+
+#include <sys/types.h>
+
+#define TIMER_WHEEL_TICK_MS 10
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_BITS 8
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+
+struct timer_entry_struct {
+  struct timer_entry_struct* prev_;
+  struct timer_entry_struct* next_;
+  u_int64_t expires_;
+  int slot_;
+  void* data_;
+};
+typedef struct timer_entry_struct timer_entry_t;
+
+struct timer_wheel_struct {
+  timer_entry_t* slots_[TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS];
+  u_int64_t pending_[TIMER_WHEEL_SLOTS / 64];
+  u_int64_t tick_;
+  u_int64_t now_;
+  int count_;
+};
+typedef struct timer_wheel_struct timer_wheel_t;
+
+void timer_entry_init(timer_entry_t* t, void* data);
+
+void timer_wheel_init(timer_wheel_t* w);
+u_int64_t timer_wheel_now(timer_wheel_t* w);
+void timer_wheel_set(timer_wheel_t* w, timer_entry_t* t, u_int64_t expires);
+void timer_wheel_cancel(timer_wheel_t* w, timer_entry_t* t);
+int timer_wheel_next(timer_wheel_t* w);
+void timer_wheel_advance(timer_wheel_t* w, void (*expired)(timer_entry_t*, void*), void* ctx);
+
+#endif
@@ -0,0 +1,214 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+/*
+ * measures the cost of accepting, relaying and closing a connection while
+ * an increasing number of idle connections is held open through the proxy.
+ * tcpproxy has to forward <proxy port> to <backend port> on localhost.
+ */
+
+static struct sockaddr_in proxy_addr;
+static int backend;
+
+static int proxy_connect()
+{
+  int c = socket(AF_INET, SOCK_STREAM, 0);
+  if(c < 0) {
+    perror("socket()");
+    return -1;
+  }
+  if(connect(c, (struct sockaddr*)(&proxy_addr), sizeof(proxy_addr))) {
+    perror("connect()");
+    close(c);
+    return -1;
+  }
+  return c;
+}
+
+static int backend_accept()
+{
+  int b = accept(backend, NULL, NULL);
+  if(b < 0)
+    perror("accept()");
+  return b;
+}
+
+static int cycle()
+{
+  char buf = 'x';
+  int c = proxy_connect();
+  if(c < 0)
+    return -1;
+  if(send(c, &buf, 1, 0) != 1) {
+    perror("send()");
+    close(c);
+    return -1;
+  }
+  int b = backend_accept();
+  if(b < 0) {
+    close(c);
+    return -1;
+  }
+  if(recv(b, &buf, 1, 0) != 1) {
+    perror("recv()");
+    close(b);
+    close(c);
+    return -1;
+  }
+  close(c);
+  while(recv(b, &buf, 1, 0) > 0);
+  close(b);
+  return 0;
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int parse_int(const char* name, const char* str, int min, int max)
+{
+  char* end;
+  errno = 0;
+  long val = strtol(str, &end, 10);
+  if(errno || end == str || *end || val < min || val > max) {
+    fprintf(stderr, "invalid %s: %s (must be between %d and %d)\n", name, str, min, max);
+    return -1;
+  }
+  return (int)val;
+}
+
+static void close_all(int* fds, int num)
+{
+  for(; num > 0; --num)
+    close(fds[num - 1]);
+}
+
+static int bench(int* idle, int* num_fds, int max_idle, int cycles)
+{
+  int level = 0;
+  for(;;) {
+    while(*num_fds < 2 * level) {
+      int fd = (*num_fds % 2) ? backend_accept() : proxy_connect();
+      if(fd < 0)
+        return -1;
+      idle[(*num_fds)++] = fd;
+    }
+
+    int i;
+    for(i = 0; i < cycles / 10; ++i)
+      if(cycle())
+        return -1;
+
+    double start = now();
+    for(i = 0; i < cycles; ++i)
+      if(cycle())
+        return -1;
+    double usec = (now() - start) * 1e6 / cycles;
+    printf("%6d idle connections: %8.1f us per accept/close cycle\n", *num_fds / 2, usec);
+
+    if(level >= max_idle)
+      return 0;
+    level = level ? level * 2 : 1000;
+    if(level > max_idle)
+      level = max_idle;
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  if(argc < 4) {
+    fprintf(stderr, "Usage: %s <proxy addr> <proxy port> <backend port> [<max idle connections> [<cycles>]]\n", argv[0]);
+    return -1;
+  }
+  int proxy_port = parse_int("proxy port", argv[2], 1, 65535);
+  int backend_port = parse_int("backend port", argv[3], 1, 65535);
+  int max_idle = argc > 4 ? parse_int("max idle connections", argv[4], 1, 1 << 20) : 8000;
+  int cycles = argc > 5 ? parse_int("cycles", argv[5], 1, 1 << 30) : 2000;
+  if(proxy_port < 0 || backend_port < 0 || max_idle < 0 || cycles < 0)
+    return -1;
+
+  proxy_addr.sin_family = AF_INET;
+  proxy_addr.sin_port = htons(proxy_port);
+  if(inet_pton(AF_INET, argv[1], &(proxy_addr.sin_addr)) <= 0) {
+    fprintf(stderr, "invalid proxy address: %s\n", argv[1]);
+    return -1;
+  }
+
+  backend = socket(AF_INET, SOCK_STREAM, 0);
+  if(backend < 0) {
+    perror("socket()");
+    return -1;
+  }
+  int on = 1;
+  setsockopt(backend, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  struct sockaddr_in baddr;
+  memset(&baddr, 0, sizeof(baddr));
+  baddr.sin_family = AF_INET;
+  baddr.sin_port = htons(backend_port);
+  baddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if(bind(backend, (struct sockaddr*)(&baddr), sizeof(baddr))) {
+    perror("bind()");
+    close(backend);
+    return -1;
+  }
+  if(listen(backend, 1024)) {
+    perror("listen()");
+    close(backend);
+    return -1;
+  }
+
+  int* idle = malloc(2 * (size_t)max_idle * sizeof(int));
+  if(!idle) {
+    perror("malloc()");
+    close(backend);
+    return -1;
+  }
+
+  /* num_fds counts the descriptors in idle[] which are open, this may be
+     odd if the proxy accepted a connection but the backend did not */
+  int num_fds = 0;
+  int ret = bench(idle, &num_fds, max_idle, cycles);
+
+  close_all(idle, num_fds);
+  free(idle);
+  close(backend);
+  return ret;
+}